@@ -0,0 +1,229 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * access.h: Access profile of the weight tables
+ *
+ * Author: Theory of Computer Games
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * the lookups of every table and the entries they have touched, shared by the
+ * agents reading the tables, e.g., the worker threads
+ *
+ * the touched entries are kept as a bitmap per table, where a bit is set once
+ * by an atomic or and only read afterward, while the lookups are counted by
+ * the agents themselves and added by add() from time to time
+ * the bitmaps are saved to 'path', if given, when the profile is destroyed,
+ * e.g., to keep only the touched entries in a sparse weight file
+ */
+class access_profile {
+ public:
+  /**
+   * a profile of tables whose entries are 'element' bytes each, e.g., 4 for
+   * float tables, see resize() for the tables
+   */
+  explicit access_profile(size_t element, const std::string& path = "")
+      : element(element), path(path) {
+    registry& r = registry::get();
+    std::lock_guard<std::mutex> lock(r.mtx);
+    r.profiles.push_back(this);
+  }
+  access_profile(const access_profile&) = delete;
+  ~access_profile() {
+    {
+      registry& r = registry::get();
+      std::lock_guard<std::mutex> lock(r.mtx);
+      r.profiles.erase(std::find(r.profiles.begin(), r.profiles.end(), this));
+    }
+    if (path.size()) save(path);
+  }
+
+  /**
+   * profile the tables of the given sizes from scratch, e.g., after a table
+   * is added; not to be called while the tables are looked up
+   */
+  void resize(const std::vector<size_t>& n) {
+    sizes = n;
+    lookups.reset(new std::atomic<uint64_t>[sizes.size()]());
+    bits.clear();
+    for (size_t k : sizes) bits.emplace_back(new std::atomic<uint64_t>[words(k)]());
+    last.assign(sizes.size(), 0);
+  }
+
+  size_t tables() const { return sizes.size(); }
+  size_t size(size_t t) const { return sizes[t]; }
+
+  /**
+   * mark entry i of table t as touched
+   */
+  void touch(size_t t, uint32_t i) {
+    std::atomic<uint64_t>& w = bits[t][i >> 6];
+    uint64_t m = uint64_t(1) << (i & 63);
+    if (!(w.load(std::memory_order_relaxed) & m))
+      w.fetch_or(m, std::memory_order_relaxed);
+  }
+  bool touched(size_t t, size_t i) const {
+    return bits[t][i >> 6].load(std::memory_order_relaxed) >> (i & 63) & 1;
+  }
+
+  /**
+   * add the lookups counted by an agent, where n[t] is of table t, and reset
+   * them to 0
+   */
+  void add(std::vector<uint64_t>& n) {
+    for (size_t t = 0; t < std::min(n.size(), tables()); t++) {
+      if (n[t]) lookups[t].fetch_add(n[t], std::memory_order_relaxed);
+      n[t] = 0;
+    }
+  }
+
+  /**
+   * print the lookups since the last report and the entries touched so far of
+   * all the profiles, e.g.,
+   *         access  table 0: n = 9831936, touched = 211680 (1.3%), lines = 104301 (6.4MB)
+   *         access  hot = 420035 entries (1.6MB), lines = 12.7MB of 128MB
+   * where 'lines' are the 64-byte cache lines holding the touched entries,
+   * i.e., the footprint in the CPU caches; nothing is printed if there is no
+   * lookup
+   */
+  static void report(std::ostream& out) {
+    registry& r = registry::get();
+    std::lock_guard<std::mutex> lock(r.mtx);
+    for (access_profile* p : r.profiles) p->print(out);
+  }
+
+  /**
+   * the layout of a saved profile (little-endian)
+   * header, then the size and the bitmap words of every table
+   */
+  struct file_header {
+    char magic[8];
+    uint32_t tables;
+    uint32_t reserved;
+  };
+  static constexpr char file_magic[8] = {'t', 'h', 'r', 'e', 'e', 's', 't', 'b'};
+
+  void save(const std::string& file) const {
+    std::ofstream out(file, std::ios::out | std::ios::binary | std::ios::trunc);
+    file_header h = {{}, uint32_t(tables()), 0};
+    std::copy(file_magic, file_magic + 8, h.magic);
+    out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    for (size_t t = 0; t < tables(); t++) {
+      uint64_t n = sizes[t];
+      out.write(reinterpret_cast<const char*>(&n), sizeof(n));
+      for (size_t k = 0; k < words(n); k++) {
+        uint64_t w = bits[t][k].load(std::memory_order_relaxed);
+        out.write(reinterpret_cast<const char*>(&w), sizeof(w));
+      }
+    }
+    if (!out) error(file, "cannot save");
+  }
+  /**
+   * the profile saved to a file, or nullptr with the error printed
+   */
+  static std::shared_ptr<access_profile> load(const std::string& file) {
+    std::ifstream in(file, std::ios::in | std::ios::binary);
+    if (!in.is_open()) return fail(file, "cannot open");
+    file_header h = {};
+    in.read(reinterpret_cast<char*>(&h), sizeof(h));
+    if (!in || !std::equal(h.magic, h.magic + 8, file_magic))
+      return fail(file, "not an access profile");
+    std::vector<size_t> sizes;
+    std::vector<std::vector<uint64_t>> maps;
+    for (uint32_t t = 0; t < h.tables && in; t++) {
+      uint64_t n = 0;
+      in.read(reinterpret_cast<char*>(&n), sizeof(n));
+      maps.emplace_back(words(n));
+      in.read(reinterpret_cast<char*>(maps.back().data()), words(n) * sizeof(uint64_t));
+      sizes.push_back(n);
+    }
+    if (!in) return fail(file, "truncated profile");
+    auto p = std::make_shared<access_profile>(0);
+    p->resize(sizes);
+    for (size_t t = 0; t < sizes.size(); t++)
+      for (size_t k = 0; k < maps[t].size(); k++) p->bits[t][k] = maps[t][k];
+    return p;
+  }
+
+ private:
+  static size_t words(size_t n) { return (n + 63) / 64; }
+
+  void print(std::ostream& out) {
+    std::vector<uint64_t> n(tables());
+    for (size_t t = 0; t < tables(); t++) {
+      uint64_t v = lookups[t].load(std::memory_order_relaxed);
+      n[t] = v - last[t];
+      last[t] = v;
+    }
+    if (std::count(n.begin(), n.end(), 0) == long(n.size())) return;
+
+    std::ios ff(nullptr);
+    ff.copyfmt(out);
+    out << std::fixed << std::setprecision(1);
+    size_t per_line = 64 / std::min<size_t>(std::max<size_t>(element, 1), 64);
+    uint64_t line = per_line < 64 ? (uint64_t(1) << per_line) - 1 : ~uint64_t(0);
+    uint64_t hot = 0, lines = 0, bytes = 0;
+    for (size_t t = 0; t < tables(); t++) {
+      uint64_t entries = 0, touched_lines = 0;
+      for (size_t k = 0; k < words(sizes[t]); k++) {
+        uint64_t w = bits[t][k].load(std::memory_order_relaxed);
+        entries += __builtin_popcountll(w);
+        for (size_t b = 0; b < 64 && w; b += per_line)
+          touched_lines += (w >> b & line) != 0;
+      }
+      hot += entries;
+      lines += touched_lines;
+      bytes += sizes[t] * element;
+      out << "\taccess\ttable " << t << ": n = " << n[t]
+          << ", touched = " << entries << " ("
+          << (entries * 100.0 / std::max<size_t>(sizes[t], 1)) << "%)"
+          << ", lines = " << touched_lines << " (" << mb(touched_lines * 64)
+          << "MB)" << std::endl;
+    }
+    out << "\taccess\thot = " << hot << " entries (" << mb(hot * element)
+        << "MB), lines = " << mb(lines * 64) << "MB of " << mb(bytes) << "MB"
+        << std::endl;
+    out.copyfmt(ff);
+  }
+  static double mb(uint64_t bytes) { return bytes / 1048576.0; }
+
+  [[noreturn]] static void error(const std::string& file, const char* what) {
+    std::cerr << "access profile " << file << ": " << what << std::endl;
+    std::exit(-1);
+  }
+  static std::nullptr_t fail(const std::string& file, const char* what) {
+    std::cerr << "access profile " << file << ": " << what << std::endl;
+    return nullptr;
+  }
+
+  struct registry {
+    std::mutex mtx;
+    std::vector<access_profile*> profiles;
+
+    static registry& get() {
+      static registry r;
+      return r;
+    }
+  };
+
+  std::vector<size_t> sizes;
+  size_t element;
+  std::string path;
+  std::unique_ptr<std::atomic<uint64_t>[]> lookups;
+  std::vector<std::unique_ptr<std::atomic<uint64_t>[]>> bits;
+  std::vector<uint64_t> last;  // the lookups at the last report
+};
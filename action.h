@@ -10,40 +10,27 @@
 #pragma once
 #include <algorithm>
 #include <string>
-#include <unordered_map>
 
 #include "board.h"
 
+/**
+ * action as a plain 32-bit code, i.e., (type:8-bit) (event:24-bit)
+ * the concrete behavior is dispatched by the type without virtual calls, so
+ * actions can be freely copied and stored by value
+ */
 class action {
  public:
   action(unsigned code = -1u) : code(code) {}
-  action(const action& a) : code(a.code) {}
-  virtual ~action() {}
+  action(const action& a) = default;
+  action& operator=(const action& a) = default;
 
   class slide;  // create a sliding action with board opcode
   class place;  // create a placing action with position and tile
 
  public:
-  virtual board::reward apply(board& b) const {
-    auto proto = entries().find(type());
-    if (proto != entries().end())
-      return proto->second->reinterpret(this).apply(b);
-    return -1;
-  }
-  virtual std::ostream& operator>>(std::ostream& out) const {
-    auto proto = entries().find(type());
-    if (proto != entries().end())
-      return proto->second->reinterpret(this) >> out;
-    return out << "??";
-  }
-  virtual std::istream& operator<<(std::istream& in) {
-    auto state = in.rdstate();
-    for (auto proto = entries().begin(); proto != entries().end(); proto++) {
-      if (proto->second->reinterpret(this) << in) return in;
-      in.clear(state);
-    }
-    return in.ignore(2);
-  }
+  inline board::reward apply(board& b) const;
+  inline std::ostream& operator>>(std::ostream& out) const;
+  inline std::istream& operator<<(std::istream& in);
 
  public:
   operator unsigned() const { return code; }
@@ -59,15 +46,6 @@ class action {
  protected:
   static constexpr unsigned type_flag(unsigned v) { return v << 24; }
 
-  typedef std::unordered_map<unsigned, action*> prototype;
-  static prototype& entries() {
-    static prototype m;
-    return m;
-  }
-  virtual action& reinterpret(const action* a) const {
-    return *new (const_cast<action*>(a)) action(*a);
-  }
-
   unsigned code;
 };
 
@@ -96,14 +74,6 @@ class action::slide : public action {
     in.setstate(std::ios::failbit);
     return in;
   }
-
- protected:
-  action& reinterpret(const action* a) const {
-    return *new (const_cast<action*>(a)) slide(*a);
-  }
-  static __attribute__((constructor)) void init() {
-    entries()[type_flag('s')] = new slide;
-  }
 };
 
 class action::place : public action {
@@ -140,12 +110,37 @@ class action::place : public action {
     in.setstate(std::ios::failbit);
     return in;
   }
-
- protected:
-  action& reinterpret(const action* a) const {
-    return *new (const_cast<action*>(a)) place(*a);
-  }
-  static __attribute__((constructor)) void init() {
-    entries()[type_flag('p')] = new place;
-  }
 };
+
+board::reward action::apply(board& b) const {
+  switch (type()) {
+    case slide::type:
+      return slide(*this).apply(b);
+    case place::type:
+      return place(*this).apply(b);
+    default:
+      return -1;
+  }
+}
+
+std::ostream& action::operator>>(std::ostream& out) const {
+  switch (type()) {
+    case slide::type:
+      return slide(*this) >> out;
+    case place::type:
+      return place(*this) >> out;
+    default:
+      return out << "??";
+  }
+}
+
+std::istream& action::operator<<(std::istream& in) {
+  auto state = in.rdstate();
+  slide s;
+  if (s << in) return operator=(s), in;
+  in.clear(state);
+  place p;
+  if (p << in) return operator=(p), in;
+  in.clear(state);
+  return in.ignore(2);
+}
@@ -9,19 +9,39 @@
  */
 
 #pragma once
+#include <fcntl.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <numeric>
 #include <random>
 #include <sstream>
 #include <string>
 #include <type_traits>
 
+#include "access.h"
 #include "action.h"
 #include "board.h"
+#include "cache.h"
+#include "ntuple.h"
+#include "pages.h"
+#include "profile.h"
+#include "ps.h"
 #include "utils.h"
 #include "weight.h"
 
@@ -161,41 +181,358 @@ class merge_larger_agent : public agent {
  */
 class random_agent : public agent {
  public:
-  random_agent(const std::string& args = "") : agent(args) {
-    if (meta.find("seed") != meta.end()) engine.seed(int(meta["seed"]));
-  }
+  random_agent(const std::string& args = "") : agent(args) { reseed(0); }
   virtual ~random_agent() {}
 
+  /**
+   * reseed the engine for the n-th episode, so that an episode is played the
+   * same whichever thread plays it, with any number of threads
+   */
+  void reseed(size_t n) { engine = episode_engine(seed(), n); }
+  static xoshiro256 episode_engine(uint64_t seed, size_t n) {
+    return xoshiro256(mix64(mix64(seed) + n));
+  }
+
+  /**
+   * the seed given by "seed=", or 0
+   */
+  unsigned seed() const {
+    if (meta.find("seed") == meta.end()) return 0;
+    return int(meta.at("seed"));
+  }
+
  protected:
-  std::default_random_engine engine;
+  xoshiro256 engine;
 };
 
 /**
  * base agent for agents with weight tables and a learning rate
+ *
+ * a copy shares the weight tables with the original agent, e.g., the workers
+ * of the parallel training; only the original agent saves the tables
+ * use "lock=N" to guard the updates with N striped locks, or the tables are
+ * updated without synchronization (Hogwild!)
+ *
+ * weight files are saved in a versioned format, which stores the patterns and
+ * every table at a page-aligned offset, so that a file can be loaded by mmap
+ * without copying: read-only and shared between processes if alpha is 0, or
+ * copy-on-write for training; legacy files are still loaded by streaming
  */
 class weight_agent : public agent {
  public:
-  weight_agent(const std::string& args = "") : agent(args), alpha(0) {
+  weight_agent(const std::string& args = "")
+      : agent(args), format(float32), alpha(0), node(-1) {
+    if (meta.find("alpha") != meta.end()) alpha = float(meta["alpha"]);
+    std::string pages, numa;
+    if (meta.find("pages") != meta.end()) pages = property("pages");
+    if (meta.find("numa") != meta.end()) numa = property("numa");
+    memory = page_policy(pages, numa);
+    if (memory.replicated() && alpha) {
+      std::cerr << "numa=replicate is for inference, i.e., alpha=0" << std::endl;
+      std::exit(-1);
+    }
+    if (memory.replicated()) replicas = std::make_shared<replica_set>();
+    if (meta.find("stages") != meta.end()) init_stages(meta["stages"]);
     if (meta.find("init") != meta.end()) init_weights(meta["init"]);
     if (meta.find("load") != meta.end()) load_weights(meta["load"]);
-    if (meta.find("alpha") != meta.end()) alpha = float(meta["alpha"]);
+    if (meta.find("load") != meta.end() && !memory.is_default()) place_tables();
+    if (meta.find("lock") != meta.end())
+      locks = std::make_shared<std::vector<std::mutex>>(int(meta["lock"]));
+  }
+  weight_agent(const weight_agent& a)
+      : agent(a),
+        net(a.net),  // the copies share the tables, see basic_weight
+        net_fp16(a.net_fp16),
+        net_int16(a.net_int16),
+        net_sparse(a.net_sparse),
+        format(a.format),
+        patterns(a.patterns),
+        stage_tiles(a.stage_tiles),
+        alpha(a.alpha),
+        locks(a.locks),
+        memory(a.memory),
+        replicas(a.replicas),
+        node(a.node) {
+    meta.erase("save");
   }
+  /**
+   * save the current weights to path, e.g., as a checkpoint, return false
+   * with the error printed rather than exit if they cannot be saved
+   */
+  bool snapshot(const std::string& path) {
+    const char* what = write_weights(path);
+    if (what) std::cerr << "weight file " << path << ": " << what << std::endl;
+    return !what;
+  }
+  /**
+   * save the current weights to path as a checkpoint, i.e., as float tables
+   * whatever "quantize=" is, so that a training resumed from them loses no
+   * precision; return false with the error printed as snapshot()
+   */
+  bool checkpoint(const std::string& path) {
+    const char* what = write_weights(path, false);
+    if (what) std::cerr << "weight file " << path << ": " << what << std::endl;
+    return !what;
+  }
+
+  /**
+   * serve the tables to the actors of a distributed training on the given
+   * port, until the given number of them have finished
+   */
+  void serve(unsigned port, size_t actors) {
+    ps_server(port, net, actors).run();
+  }
+
+  /**
+   * whether the tables are trained, i.e., alpha is not 0
+   */
+  bool learning() const { return alpha != 0; }
+
   virtual ~weight_agent() {
     if (meta.find("save") != meta.end()) save_weights(meta["save"]);
   }
 
+  /**
+   * with "numa=replicate", switch to the copy of the tables on the node of
+   * the calling thread, which is made by the first thread on that node
+   */
+  void localize() {
+    if (!replicas) return;
+    int n = page_policy::current_node();
+    if (n == node) return;
+    std::lock_guard<std::mutex> lock(replicas->mtx);
+    if (replicas->nodes.empty()) replicas->master = {net, net_fp16, net_int16};
+    replica& r = replicas->nodes[n];
+    if (r.net.empty() && r.net_fp16.empty() && r.net_int16.empty()) {
+      const replica& m = replicas->master;
+      for (const weight& w : m.net) r.net.push_back(place_table(w, n));
+      for (const half_weight& w : m.net_fp16) r.net_fp16.push_back(place_table(w, n));
+      for (const int16_weight& w : m.net_int16) r.net_int16.push_back(place_table(w, n));
+    }
+    net = r.net;
+    net_fp16 = r.net_fp16;
+    net_int16 = r.net_int16;
+    node = n;
+  }
+
  protected:
+  /**
+   * a n-tuple pattern and the table it is looked up in
+   */
+  struct pattern {
+    std::vector<unsigned> cells;
+    unsigned table;
+    unsigned iso;
+    bool operator==(const pattern& p) const {
+      return cells == p.cells && table == p.table && iso == p.iso;
+    }
+  };
+
+  /**
+   * the storage of the tables, where the quantized and the sparse ones are
+   * for inference: such a file loaded with alpha != 0 is converted back to
+   * float
+   */
+  enum table_format : uint32_t { float32 = 0, fp16 = 1, int16 = 2, sparse = 3 };
+
+  /**
+   * layout of the weight file (little-endian)
+   * header, stages, table entries, pattern entries, then the tables at
+   * page-aligned offsets, each of them holding 'size' packed weights of its
+   * format, or a sparse table holding the number of its slots (uint64_t)
+   * followed by the slots, see sparse_weight
+   * version 1 files have no format (float32) and scale in the table entries,
+   * and version 1 and 2 files have no stages, i.e., a single stage
+   */
+  struct file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t tables;
+    uint32_t patterns;
+    uint32_t align;
+  };
+  struct file_stages {
+    uint32_t count;  // the number of stages minus 1
+    uint8_t tiles[12];  // the tile (index value) starting stage i + 1
+  };
+  struct file_table {
+    uint64_t offset;
+    uint64_t size;
+    uint32_t format;
+    float scale;  // of int16 entries
+  };
+  struct file_pattern {
+    uint32_t table;
+    uint32_t iso;
+    uint32_t size;
+    uint8_t cells[8];
+  };
+  static constexpr char file_magic[8] = {'t', 'h', 'r', 'e', 'e', 's', 'n', 't'};
+  static constexpr uint32_t file_version = 3;
+  static constexpr uint32_t file_align = 4096;
+
   virtual void init_weights(const std::string& info) {
     std::string res = info;  // comma-separated sizes, e.g., "65536,65536"
     for (char& ch : res)
       if (!std::isdigit(ch)) ch = ' ';
     std::stringstream in(res);
-    for (size_t size; in >> size; net.emplace_back(size))
+    for (size_t size; in >> size; net.push_back(allocate_table<weight>(size)))
       ;
   }
+
+  /**
+   * split the game into stages by the largest tile, e.g., "384,1536" for
+   * three stages starting from the beginning, a 384-tile, and a 1536-tile,
+   * where every stage has its own tables, see stage()
+   */
+  virtual void init_stages(const std::string& info) {
+    std::string res = info;
+    for (char& ch : res)
+      if (!std::isdigit(ch)) ch = ' ';
+    std::stringstream in(res);
+    for (unsigned tile; in >> tile;) {
+      board::cell t = board::ttoi(tile);
+      if (t < 1 || t > 15 || board::itot(t) != tile ||
+          (stage_tiles.size() && t <= stage_tiles.back()) ||
+          stage_tiles.size() >= sizeof(file_stages::tiles)) {
+        std::cerr << "invalid stages " << info << std::endl;
+        std::exit(-1);
+      }
+      stage_tiles.push_back(t);
+    }
+  }
+
+  /**
+   * the number of stages, and the stage of a board, i.e., the number of the
+   * stage tiles it has reached; table t of stage s is net[t * stages() + s]
+   */
+  unsigned stages() const { return stage_tiles.size() + 1; }
+  unsigned stage(const board& b) const {
+    unsigned s = 0;
+    for (board::cell t : stage_tiles) s += b.reaches(t);
+    return s;
+  }
+
+  /**
+   * a zeroed table allocated as given by "pages=" and "numa=", on the given
+   * node unless it is -1
+   */
+  template <typename table>
+  table allocate_table(size_t size, int node = -1, float scale = 1) const {
+    if (memory.is_default() && node < 0) return table(size, scale);
+    typedef typename table::type type;
+    std::shared_ptr<void> mem = memory.allocate(size * sizeof(type), node);
+    return table(static_cast<type*>(mem.get()), size, mem, scale);
+  }
+  template <typename table>
+  table place_table(const table& w, int node = -1) const {
+    table t = allocate_table<table>(w.size(), node, w.scale());
+    std::copy(w.data(), w.data() + w.size(), t.data());
+    return t;
+  }
+  /**
+   * move the loaded tables, e.g., those mapped from a file, to the memory
+   * allocated as given by "pages=" and "numa="
+   */
+  void place_tables() {
+    for (weight& w : net) w = place_table(w);
+    for (half_weight& w : net_fp16) w = place_table(w);
+    for (int16_weight& w : net_int16) w = place_table(w);
+  }
   virtual void load_weights(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) error(path, "cannot open");
+    file_header h = {};
+    struct stat st;
+    if (::fstat(fd, &st) != 0) error(path, "cannot stat");
+    if (size_t(st.st_size) < sizeof(h) || ::pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+        !std::equal(h.magic, h.magic + 8, file_magic)) {
+      ::close(fd);
+      return load_legacy_weights(path);
+    }
+    if (h.version < 1 || h.version > file_version)
+      error(path, "unsupported version");
+
+    // read-only pages are shared by all the processes mapping the file, while
+    // private writable pages are copied on the first update
+    int prot = alpha ? PROT_READ | PROT_WRITE : PROT_READ;
+    int flags = alpha ? MAP_PRIVATE : MAP_SHARED;
+    size_t len = st.st_size;
+    void* addr = ::mmap(nullptr, len, prot, flags, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) error(path, "cannot map");
+    std::shared_ptr<void> owner(addr, [len](void* p) { ::munmap(p, len); });
+
+    auto base = static_cast<char*>(addr);
+    size_t entry = h.version == 1 ? 2 * sizeof(uint64_t) : sizeof(file_table);
+    size_t stages = sizeof(h), tables = stages;
+    if (h.version >= 3) tables += sizeof(file_stages);
+    size_t shapes = tables + h.tables * entry;
+    if (shapes + h.patterns * sizeof(file_pattern) > len)
+      error(path, "truncated header");
+    file_stages fs = {};
+    if (h.version >= 3) std::memcpy(&fs, base + stages, sizeof(fs));
+    if (fs.count > sizeof(fs.tiles)) error(path, "invalid stages");
+    std::vector<board::cell> tiles(fs.tiles, fs.tiles + fs.count);
+    if (meta.find("stages") != meta.end() && tiles != stage_tiles)
+      error(path, "mismatched stages");
+    stage_tiles = tiles;
+    net.clear();
+    net_fp16.clear();
+    net_int16.clear();
+    net_sparse.clear();
+    for (size_t i = 0; i < h.tables; i++) {
+      file_table t = {};
+      std::memcpy(&t, base + tables + i * entry, entry);
+      if (i == 0) format = table_format(t.format);
+      if (t.format != format) error(path, "mixed table formats");
+      if (format > sparse) error(path, "unsupported table format");
+      uint64_t slots = 0;
+      if (format == sparse && t.offset + sizeof(slots) <= len)
+        std::memcpy(&slots, base + t.offset, sizeof(slots));
+      if (format == sparse && (slots < 2 || (slots & (slots - 1))))
+        error(path, "invalid sparse table");
+      size_t bytes = format == sparse ? sizeof(slots) + slots * element_size(format)
+                                      : t.size * element_size(format);
+      if (t.offset + bytes > len) error(path, "truncated table");
+      char* data = base + t.offset;
+      if (format == float32)
+        net.emplace_back(reinterpret_cast<float*>(data), t.size, owner);
+      if (format == fp16)
+        net_fp16.emplace_back(reinterpret_cast<half*>(data), t.size, owner);
+      if (format == int16)
+        net_int16.emplace_back(reinterpret_cast<int16_t*>(data), t.size,
+                               owner, t.scale);
+      if (format == sparse)
+        net_sparse.emplace_back(reinterpret_cast<sparse_weight::slot*>(data + sizeof(slots)),
+                                slots, t.size, owner);
+      if (format == sparse && !net_sparse.back().valid())
+        error(path, "sparse table without an empty slot");
+    }
+    if (format != float32 && alpha) {
+      std::vector<weight> tables(table_count());
+      for (size_t t = 0; t < tables.size(); t++) {
+        tables[t] = weight(table_size(t));
+        for (size_t i = 0; i < tables[t].size(); i++)
+          tables[t][i] = table_value(t, i);
+      }
+      net.swap(tables);
+      net_fp16.clear();
+      net_int16.clear();
+      net_sparse.clear();
+      format = float32;
+    }
+    patterns.clear();
+    for (size_t i = 0; i < h.patterns; i++) {
+      file_pattern p;
+      std::memcpy(&p, base + shapes + i * sizeof(p), sizeof(p));
+      if (p.size > 8) error(path, "invalid pattern");
+      patterns.push_back({{p.cells, p.cells + p.size}, p.table, p.iso});
+    }
+  }
+  virtual void load_legacy_weights(const std::string& path) {
     std::ifstream in(path, std::ios::in | std::ios::binary);
-    if (!in.is_open()) std::exit(-1);
+    if (!in.is_open()) error(path, "cannot open");
     uint32_t size;
     in.read(reinterpret_cast<char*>(&size), sizeof(size));
     net.resize(size);
@@ -203,17 +540,234 @@ class weight_agent : public agent {
     in.close();
   }
   virtual void save_weights(const std::string& path) {
-    std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
-    if (!out.is_open()) std::exit(-1);
-    uint32_t size = net.size();
-    out.write(reinterpret_cast<char*>(&size), sizeof(size));
-    for (weight& w : net) out << w;
+    if (const char* what = write_weights(path)) error(path, what);
+  }
+  /**
+   * save the weights to path, return what went wrong or nullptr, e.g., for a
+   * checkpoint saved by a forked child, which should not exit as the parent
+   * the tables are converted as given by "quantize=" if 'quantized' is set,
+   * or else saved as float tables
+   */
+  const char* write_weights(const std::string& path, bool quantized = true) {
+    // write to a temporary file then rename it, since the old file may still
+    // be mapped by this or other processes
+    std::string temp = path + ".tmp";
+    std::ofstream out(temp, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) return "cannot create";
+
+    // the tables are saved as they are, or converted by "quantize=fp16",
+    // "quantize=int16", "quantize=sparse", or "quantize=float32"
+    table_format target = quantized ? format : float32;
+    if (quantized && meta.find("quantize") != meta.end()) {
+      std::string q = meta["quantize"];
+      if (q == "float32") target = float32;
+      else if (q == "fp16") target = fp16;
+      else if (q == "int16") target = int16;
+      else if (q == "sparse") target = sparse;
+      else return "unknown quantization";
+    }
+
+    // a sparse table keeps its non-zero entries, or only those touched in
+    // the access profile given by "touched=", see access_profile
+    std::shared_ptr<access_profile> hot;
+    if (target == sparse && meta.find("touched") != meta.end()) {
+      hot = access_profile::load(meta["touched"]);
+      if (!hot) return "cannot load the access profile";
+      bool match = hot->tables() == table_count();
+      for (size_t i = 0; match && i < table_count(); i++)
+        match = hot->size(i) == table_size(i);
+      if (!match) return "mismatched access profile";
+    }
+
+    file_header h = {};
+    std::copy(file_magic, file_magic + 8, h.magic);
+    h.version = file_version;
+    h.tables = table_count();
+    h.patterns = patterns.size();
+    h.align = file_align;
+    out.write(reinterpret_cast<char*>(&h), sizeof(h));
+    size_t count = std::min(stage_tiles.size(), sizeof(file_stages::tiles));
+    file_stages fs = {uint32_t(count), {}};
+    std::copy(stage_tiles.begin(), stage_tiles.begin() + count, fs.tiles);
+    out.write(reinterpret_cast<char*>(&fs), sizeof(fs));
+
+    size_t offset = sizeof(h) + sizeof(fs) + h.tables * sizeof(file_table) +
+                    h.patterns * sizeof(file_pattern);
+    std::vector<file_table> tables;
+    std::vector<std::string> converted(h.tables);
+    for (size_t i = 0; i < h.tables; i++) {
+      offset = (offset + file_align - 1) / file_align * file_align;
+      file_table t = {offset, table_size(i), target, table_scale(i)};
+      if (target != format || target == sparse)
+        converted[i] = convert_table(i, target, t.scale, hot.get());
+      tables.push_back(t);
+      offset += target != format || target == sparse
+                    ? converted[i].size()
+                    : t.size * element_size(target);
+    }
+    for (file_table& t : tables)
+      out.write(reinterpret_cast<char*>(&t), sizeof(t));
+    for (pattern& p : patterns) {
+      size_t n = std::min(p.cells.size(), sizeof(file_pattern::cells));
+      file_pattern f = {p.table, p.iso, uint32_t(n), {}};
+      std::copy(p.cells.begin(), p.cells.begin() + n, f.cells);
+      out.write(reinterpret_cast<char*>(&f), sizeof(f));
+    }
+    for (size_t i = 0; i < h.tables; i++) {
+      std::vector<char> pad(tables[i].offset - size_t(out.tellp()));
+      out.write(pad.data(), pad.size());
+      if (target != format || target == sparse) {
+        out.write(converted[i].data(), converted[i].size());
+      } else {
+        out.write(table_data(i), tables[i].size * element_size(format));
+      }
+    }
     out.close();
+    if (!out || std::rename(temp.c_str(), path.c_str()) != 0)
+      return "cannot save";
+    return nullptr;
+  }
+
+  /**
+   * the table entries in the storage of another format, where a sparse table
+   * keeps the entries touched in 'hot', if given, or the non-zero ones
+   */
+  std::string convert_table(size_t t, table_format target, float& scale,
+                            const access_profile* hot = nullptr) const {
+    size_t n = table_size(t);
+    if (target == sparse) {
+      std::vector<sparse_weight::slot> slots;
+      if (format == sparse && !hot) {
+        const sparse_weight& w = net_sparse[t];
+        slots.assign(w.data(), w.data() + w.slots());
+      } else {
+        auto index = [](size_t i) { return i; };
+        auto value = [&](size_t i) {
+          return !hot || hot->touched(t, i) ? table_value(t, i) : 0.0f;
+        };
+        slots = sparse_weight::build(n, index, value);
+      }
+      uint64_t count = slots.size();
+      std::string buf(sizeof(count) + count * sizeof(sparse_weight::slot), '\0');
+      std::memcpy(&buf[0], &count, sizeof(count));
+      std::memcpy(&buf[sizeof(count)], slots.data(), count * sizeof(sparse_weight::slot));
+      return buf;
+    }
+    std::string buf(n * element_size(target), '\0');
+    if (target == float32) {
+      for (size_t i = 0; i < n; i++) {
+        float v = table_value(t, i);
+        std::memcpy(&buf[i * sizeof(v)], &v, sizeof(v));
+      }
+    } else if (target == fp16) {
+      for (size_t i = 0; i < n; i++) {
+        half v = half::from(table_value(t, i));
+        std::memcpy(&buf[i * sizeof(v)], &v, sizeof(v));
+      }
+    } else {
+      float max = 0;
+      for (size_t i = 0; i < n; i++) max = std::max(max, std::fabs(table_value(t, i)));
+      scale = max ? max / 32767 : 1;
+      for (size_t i = 0; i < n; i++) {
+        int16_t v = int16_t(std::lrint(table_value(t, i) / scale));
+        std::memcpy(&buf[i * sizeof(v)], &v, sizeof(v));
+      }
+    }
+    return buf;
+  }
+
+  /**
+   * the bytes of an entry, or of a slot of a sparse table
+   */
+  static size_t element_size(table_format f) {
+    if (f == sparse) return sizeof(sparse_weight::slot);
+    return f == float32 ? sizeof(float) : sizeof(int16_t);
+  }
+  size_t table_count() const {
+    if (format == fp16) return net_fp16.size();
+    if (format == int16) return net_int16.size();
+    if (format == sparse) return net_sparse.size();
+    return net.size();
+  }
+  size_t table_size(size_t t) const {
+    if (format == fp16) return t < net_fp16.size() ? net_fp16[t].size() : 0;
+    if (format == int16) return t < net_int16.size() ? net_int16[t].size() : 0;
+    if (format == sparse) return t < net_sparse.size() ? net_sparse[t].size() : 0;
+    return t < net.size() ? net[t].size() : 0;
+  }
+  /**
+   * the memory taken by a table, e.g., the slots of a sparse table
+   */
+  size_t table_bytes(size_t t) const {
+    if (format == sparse) return net_sparse[t].slots() * element_size(format);
+    return table_size(t) * element_size(format);
+  }
+  float table_value(size_t t, size_t i) const {
+    if (format == fp16) return net_fp16[t].get(i);
+    if (format == int16) return net_int16[t].get(i);
+    if (format == sparse) return net_sparse[t].get(i);
+    return net[t][i];
+  }
+  float table_scale(size_t t) const {
+    return format == int16 ? net_int16[t].scale() : 1;
+  }
+  const char* table_data(size_t t) const {
+    if (format == fp16) return reinterpret_cast<const char*>(net_fp16[t].data());
+    if (format == int16) return reinterpret_cast<const char*>(net_int16[t].data());
+    return reinterpret_cast<const char*>(net[t].data());
+  }
+
+  [[noreturn]] static void error(const std::string& path, const char* what) {
+    std::cerr << "weight file " << path << ": " << what << std::endl;
+    std::exit(-1);
+  }
+  /**
+   * where the tables come from, for the errors, e.g., "init=65536,65536"
+   */
+  std::string source() const {
+    if (meta.find("load") != meta.end()) return property("load");
+    if (meta.find("init") != meta.end()) return "init=" + property("init");
+    return "(patterns)";
+  }
+
+  /**
+   * add v to a weight, which may be shared with other threads
+   */
+  void update(weight::type* w, weight::type v) {
+    if (!locks) {
+      *w += v;
+      return;
+    }
+    auto line = reinterpret_cast<std::uintptr_t>(w) / 64;
+    std::lock_guard<std::mutex> guard((*locks)[line % locks->size()]);
+    *w += v;
   }
 
  protected:
   std::vector<weight> net;
+  std::vector<half_weight> net_fp16;  // the tables of a quantized file,
+  std::vector<int16_weight> net_int16;  // used instead of net if loaded
+  std::vector<sparse_weight> net_sparse;
+  table_format format;
+  std::vector<pattern> patterns;  // the patterns of the tables, if known
+  std::vector<board::cell> stage_tiles;  // the largest tiles starting stages
   float alpha;
+  std::shared_ptr<std::vector<std::mutex>> locks;
+
+  // the allocation of the tables, and their copies per node if replicated
+  struct replica {
+    std::vector<weight> net;
+    std::vector<half_weight> net_fp16;
+    std::vector<int16_weight> net_int16;
+  };
+  struct replica_set {
+    std::mutex mtx;
+    replica master;
+    std::map<int, replica> nodes;
+  };
+  page_policy memory;
+  std::shared_ptr<replica_set> replicas;
+  int node;  // the node of the current replica, or -1
 };
 
 /**
@@ -223,35 +777,73 @@ class weight_agent : public agent {
 class random_placer : public random_agent {
  public:
   random_placer(const std::string& args = "")
-      : random_agent("name=place role=placer " + args) {
-    spaces[0] = {12, 13, 14, 15};
-    spaces[1] = {0, 4, 8, 12};
-    spaces[2] = {0, 1, 2, 3};
-    spaces[3] = {3, 7, 11, 15};
-    spaces[4] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
-  }
+      : random_agent("name=place role=placer " + args) {}
 
-  virtual action take_action(const board& after) {
-    std::vector<int> space = spaces[after.last()];
-    std::shuffle(space.begin(), space.end(), engine);
-    for (int pos : space) {
-      if (after(pos) != 0) continue;
+  /**
+   * the positions where a tile can be placed after the last action
+   */
+  static const std::vector<int>& spaces(unsigned last) {
+    static const std::vector<int> space[5] = {
+        {12, 13, 14, 15},
+        {0, 4, 8, 12},
+        {0, 1, 2, 3},
+        {3, 7, 11, 15},
+        {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15}};
+    return space[last];
+  }
 
-      int bag[3], num = 0;
-      for (board::cell t = 1; t <= 3; t++)
-        for (size_t i = 0; i < after.bag(t); i++) bag[num++] = t;
-      std::shuffle(bag, bag + num, engine);
+  /**
+   * the positions of spaces(last) as a mask, where bit (i) is cell (i)
+   */
+  static unsigned space_mask(unsigned last) {
+    static const unsigned mask[5] = {0xf000, 0x1111, 0x000f, 0x8888, 0xffff};
+    return mask[last];
+  }
 
-      board::cell tile = after.hint() ?: bag[--num];
-      board::cell hint = bag[--num];
+  virtual action take_action(const board& after) {
+    return choose(after, engine);
+  }
 
-      return action::place(pos, tile, hint);
-    }
-    return action();
+  /**
+   * place the hint tile at a random empty cell of the spaces, and draw the
+   * next hint from the bag, e.g., for the games of batch_simulator which have
+   * their own engines
+   */
+  static action choose(const board& after, xoshiro256& engine) {
+    unsigned empty = after.empty() & space_mask(after.last());
+    if (empty == 0) return action();
+    unsigned k = engine.below(__builtin_popcount(empty));
+#if defined(__BMI2__)
+    empty = _pdep_u32(1u << k, empty);  // the k-th empty space
+#elif defined(__x86_64__)
+    if (board::bmi2()) empty = deposit_bmi2(1u << k, empty);
+    else for (; k; k--) empty &= empty - 1;
+#else
+    for (; k; k--) empty &= empty - 1;
+#endif
+    unsigned pos = __builtin_ctz(empty);
+
+    unsigned bag[4] = {0, after.bag(1), after.bag(2), after.bag(3)};
+    unsigned left = bag[1] + bag[2] + bag[3];
+    auto draw = [&]() {
+      unsigned r = engine.below(left--);
+      board::cell t = 1;
+      while (r >= bag[t]) r -= bag[t++];
+      bag[t]--;
+      return t;
+    };
+    board::cell tile = after.hint() ?: draw();
+    board::cell hint = draw();
+    return action::place(pos, tile, hint);
   }
 
+#if !defined(__BMI2__) && defined(__x86_64__)
  private:
-  std::vector<int> spaces[5];
+  __attribute__((target("bmi2"))) static unsigned deposit_bmi2(unsigned v,
+                                                               unsigned mask) {
+    return _pdep_u32(v, mask);
+  }
+#endif
 };
 
 /**
@@ -261,153 +853,842 @@ class random_placer : public random_agent {
 class random_slider : public random_agent {
  public:
   random_slider(const std::string& args = "")
-      : random_agent("name=slide role=slider " + args), opcode({0, 1, 2, 3}) {}
+      : random_agent("name=slide role=slider " + args) {}
 
   virtual action take_action(const board& before) {
-    std::shuffle(opcode.begin(), opcode.end(), engine);
-    for (int op : opcode) {
-      board::reward reward = board(before).slide(op);
-      if (reward != -1) return action::slide(op);
-    }
-    return action();
+    int legal[4], num = 0;
+    for (int op = 0; op < 4; op++)
+      if (board(before).slide(op) != -1) legal[num++] = op;
+    return num ? action::slide(legal[engine.below(num)]) : action();
   }
-
- private:
-  std::array<int, 4> opcode;
 };
 
 class ntuple_slider : public weight_agent {
  public:
   ntuple_slider(const std::string& args) : weight_agent(args) {
-    tuple_n = net.size();
+    tuple_n = 0;
+    shapes = 0;
+    stored = patterns.size();
+    specialized = nullptr;
 
     prev_reward = 0;
+    trace.reserve(1000 * 16);
+    trace_stage.reserve(1000);
+    rewards.reserve(1000);
+
+    // the learning rule, see close_episode
+    lambda = 0;
+    coherent = false;
+    delay = 0;
+    delayed = 0;
+    if (meta.find("lambda") != meta.end()) lambda = float(meta["lambda"]);
+    if (meta.find("tc") != meta.end()) coherent = int(meta["tc"]) != 0;
+    if (meta.find("delay") != meta.end()) delay = std::max(int(meta["delay"]), 0);
+    if (lambda < 0 || lambda > 1) {
+      std::cerr << "lambda should be in [0, 1]" << std::endl;
+      std::exit(-1);
+    }
+
+    // the code path of the evaluation, the best one of the CPU by default
+    simd = supports(avx2) ? avx2 : scalar;
+    if (meta.find("simd") != meta.end() && property("simd") != "auto") {
+      std::string path = meta["simd"];
+      const char* names[] = {"scalar", "avx2", "avx512"};
+      auto it = std::find(std::begin(names), std::end(names), path);
+      simd = simd_path(it - std::begin(names));
+      if (it == std::end(names) || !supports(simd)) {
+        std::cerr << "simd=" << path << " is not supported" << std::endl;
+        std::exit(-1);
+      }
+    }
+
+    // the values of the afterstates cached in 2^B sets, shared by the copies
+    generation = std::make_shared<std::atomic<uint32_t>>(1);
+    if (meta.find("cache") != meta.end()) {
+      unsigned bits = int(meta["cache"]);
+      if (bits > 32) {
+        std::cerr << "cache should be at most 32 bits" << std::endl;
+        std::exit(-1);
+      }
+      cache = std::make_shared<value_cache>(bits);
+    }
+
+    // the access profile of the tables shared by the copies, reported with
+    // the statistics and saved to the given file, see access_profile
+    if (meta.find("access") != meta.end())
+      accesses = std::make_shared<access_profile>(element_size(format), meta["access"]);
+
+    // a predefined pattern set, see ntuple_registry
+    if (meta.find("patterns") != meta.end()) {
+      const ntuple_registry::entry* set = ntuple_registry::find(meta["patterns"]);
+      if (!set) {
+        std::cerr << "unknown patterns " << property("patterns") << std::endl;
+        std::exit(-1);
+      }
+      set_encoding(std::vector<std::vector<unsigned>>(set->encoding), 8);
+    } else if (stored) {
+      set_stored_encoding();
+    } else {
+      set_default_encoding();
+    }
+
+    // an actor of a distributed training, see ps.h
+    sync = 100;
+    episodes = 0;
+    if (meta.find("server") != meta.end())
+      remote = std::make_shared<ps_client>(meta["server"]);
+    if (meta.find("sync") != meta.end()) sync = std::max(int(meta["sync"]), 1);
+  }
+  virtual ~ntuple_slider() {
+    flush();
+    if (remote && deltas.size()) remote->push(deltas);
+    if (accesses) accesses->add(lookups);
   }
 
-  void set_encoding(std::vector<std::vector<unsigned>>&& e) { encodings = e; }
+  /**
+   * add a n-tuple pattern, e.g., {0, 1, 2, 4, 5, 6}, looked up in net[table]
+   * the first 'iso' of the 8 rotations and reflections of the pattern are
+   * added as well, all of them sharing the same table
+   * the table is allocated here if it has not been initialized or loaded
+   * with "stages=", every stage has its own copy of the table, see stage()
+   * with "tc=1", the accumulators of the table are allocated as well
+   * with "access=FILE", the access profile is reset to all the tables
+   */
+  void add_pattern(const std::vector<unsigned>& cells, unsigned table,
+                   unsigned iso = 8) {
+    if (cells.empty() || cells.size() > max_tuple)
+      error(source(), "invalid pattern size");
+    if (features.size() + iso > max_features || iso < 1 || iso > 8)
+      error(source(), "too many pattern isomorphisms");
+    size_t size = 1ull << (4 * cells.size());
+    for (unsigned s = 0, t = table * stages(); s < stages(); s++, t++) {
+      if (format == float32 && t >= net.size()) net.resize(t + 1);
+      if (format == float32 && net[t].size() == 0)
+        net[t] = allocate_table<weight>(size);
+      if (table_size(t) < size)
+        error(source(), "table too small for its pattern");
+      if (!coherent || alpha == 0) continue;
+      if (t >= tc_e.size()) tc_e.resize(t + 1), tc_a.resize(t + 1);
+      if (tc_e[t].size() < table_size(t)) {
+        tc_e[t] = allocate_table<weight>(table_size(t));
+        tc_a[t] = allocate_table<weight>(table_size(t));
+      }
+    }
+
+    for (unsigned i = 0; i < iso; i++) {
+      board idx(0xfedcba9876543210ull, 0);  // cell (k) holds position k
+      if (i >= 4) idx.reflect_horizontal();
+      idx.rotate(i % 4);
+
+      // 8 isomorphisms of a pattern with indices below 2^31 share one gather
+      bool gather = i == 0 && iso == 8 && cells.size() < max_tuple;
+      feature f = {{}, unsigned(cells.size()), table, gather};
+      for (size_t k = 0; k < cells.size(); k++) f.cells[k] = idx(cells[k]);
+      features.push_back(f);
+    }
+    tuple_n = features.size();
+    specialized = nullptr;
+
+    // the patterns given by a loaded weight file should be followed exactly
+    pattern p = {cells, table, iso};
+    if (shapes < patterns.size() && !(patterns[shapes] == p))
+      error(property("load"), "mismatched patterns");
+    if (shapes++ >= patterns.size()) patterns.push_back(p);
+
+    if (accesses) {
+      std::vector<size_t> sizes(table_count());
+      for (size_t t = 0; t < sizes.size(); t++) sizes[t] = table_size(t);
+      accesses->resize(sizes);
+      lookups.assign(sizes.size(), 0);
+    }
+  }
+
+  /**
+   * set the patterns, where pattern i is looked up in its own table net[i]
+   * a predefined set with all 8 isomorphisms is indexed by its compile-time
+   * specialization instead of the generic loop
+   */
+  void set_encoding(std::vector<std::vector<unsigned>>&& e, unsigned iso = 8) {
+    clear_patterns();
+    for (size_t i = 0; i < e.size(); i++) add_pattern(e[i], i, iso);
+    const ntuple_registry::entry* set = ntuple_registry::find(e);
+    if (set && iso == 8) specialized = set->indices;
+  }
+
+  /**
+   * set the patterns stored in the loaded weight file, which are used unless
+   * others are given, so the file can be loaded without repeating them
+   */
+  void set_stored_encoding() {
+    std::vector<pattern> p(patterns.begin(), patterns.begin() + stored);
+    std::vector<std::vector<unsigned>> e;
+    for (size_t i = 0; i < p.size(); i++) {
+      if (p[i].table == i && p[i].iso == 8) e.push_back(p[i].cells);
+    }
+    if (e.size() == p.size()) return set_encoding(std::move(e), 8);
+    clear_patterns();
+    for (const pattern& q : p) add_pattern(q.cells, q.table, q.iso);
+  }
+
+  /**
+   * set the patterns of the original slider, which are used unless others
+   * are given: four 6-tuples without their isomorphisms, where pattern i is
+   * looked up in net[i % 2], as in the weight files of the old format
+   */
+  void set_default_encoding() {
+    const std::vector<std::vector<unsigned>> e = {
+        {0, 1, 2, 4, 5, 6},
+        {4, 5, 6, 8, 9, 10},
+        {5, 6, 7, 9, 10, 11},
+        {9, 10, 11, 13, 14, 15}};
+    clear_patterns();
+    for (size_t i = 0; i < e.size(); i++) add_pattern(e[i], i % 2, 1);
+  }
 
   virtual void open_episode(const std::string& flag = "") {
     prev_reward = 0;
-    t.clear();
-    t.reserve(1000);
+    trace.clear();  // the capacity is kept for the next episodes
+    trace_stage.clear();
+    rewards.clear();
+    if (remote && remote->pulls() == 0) {
+      remote->pull(net);
+      invalidate();
+    }
+    localize();
   }
 
+  /**
+   * TD(lambda) backward over the episode, where the target of an afterstate
+   * is the lambda-return r + (1 - lambda) * V(next) + lambda * target(next),
+   * i.e., TD(0) if lambda is 0
+   *
+   * with "delay=K", the errors are kept and applied every K episodes, merged
+   * by weight and sorted by table and index, see flush()
+   */
   virtual void close_episode(const std::string& flag = "") {
+    if (accesses) accesses->add(lookups);
+    if (alpha == 0) return;  // the tables may be mapped read-only
+    PROFILE_SCOPE(profile::update);
+
     float r = 0.0f;
     float next_value = 0.0f;
+    float next_target = 0.0f;
+    size_t width = features.size();
 
-    for (auto iter = t.rbegin(); iter != t.rend(); ++iter) {
-      auto [current_state, _r] = *iter;
+    for (size_t i = rewards.size(); i-- > 0;) {
+      const uint32_t* index = &trace[i * width];
+      unsigned s = trace_stage[i];
 
       float current_value = 0.0f;
-      for (auto& w : current_state) current_value += *w;
+      for (size_t k = 0; k < width; k++)
+        current_value += net[table(k, s)][index[k]];
+
+      float target = r + next_value;
+      if (lambda) target = r + (1 - lambda) * next_value + lambda * next_target;
+      auto loss = target - current_value;
+
+      if (delay) {
+        for (size_t k = 0; k < width; k++)
+          pending.push_back({unsigned(table(k, s)), index[k], loss});
+      } else {
+        for (size_t k = 0; k < width; k++) learn(table(k, s), index[k], loss);
+      }
 
-      auto loss = r + next_value - current_value;
+      next_value = current_value;
+      next_target = target;
+      r = rewards[i];
+    }
+    if (delay && ++delayed % delay == 0) flush();
+    if (!delay) invalidate();
+
+    // send the local updates to the server and fetch the others' every
+    // 'sync' episodes
+    if (remote && ++episodes % sync == 0) {
+      remote->push(deltas);
+      remote->pull(net);
+      invalidate();
+    }
+  }
 
-      /*
-      std::cout << "=============\n";
-      std::cout << "current_value: " << current_value << '\n';
-      std::cout << "reward: " << _r << '\n';
-      std::cout << "loss: " << loss << '\n';
-      std::cout << "=============\n";
-      */
+  /**
+   * apply the delayed errors, each weight once
+   */
+  void flush() {
+    if (pending.empty()) return;
+    PROFILE_SCOPE(profile::update);
+    ps::coalesce(pending);
+    for (const ps_delta& d : pending) learn(d.table, d.index, d.value);
+    pending.clear();  // the capacity is kept for the next episodes
+    invalidate();
+  }
 
-      for (auto& w : current_state) *w += alpha * loss;
+  virtual action take_action(const board& b) {
+    afterstates a;
+    evaluate(b, a);
+
+    size_t best_action = argmax(a.value, a.value + 4);
+    if (a.reward[best_action] == -1) return action();
+
+    // only record the trajectory for training, reusing the indices above
+    if (alpha != 0) {
+      size_t width = features.size();
+      const uint32_t* idx = a.idx[best_action];
+      trace.insert(trace.end(), idx, idx + width);
+      trace_stage.push_back(a.stage[best_action]);
+      rewards.push_back(reward_fn(a.reward[best_action]));
+    }
 
-      next_value = current_value;
-      r = _r;
+    return action::slide(best_action);
+  }
+
+  /**
+   * choose the slides of many boards at once, e.g., the games of
+   * batch_simulator, where opcode[i] is the slide take_action would choose
+   * for before[i], or -1 if there is none; nothing is recorded for training
+   * value[i], if given, is the reward plus the value of the afterstate of
+   * the chosen slide, or 0 if there is none
+   * the boards are evaluated in groups, and the weights of a group are
+   * prefetched while those of the previous group are summed up
+   */
+  void take_actions(const board::bits* before, size_t n, int* opcode,
+                    float* value = nullptr) {
+    constexpr size_t group = 8;
+    afterstates a[2][group];
+    for (size_t g = 0; g < n + group; g += group) {
+      size_t cur = (g / group) % 2, prev = cur ^ 1;
+      for (size_t i = g; i < std::min(g + group, n); i++)
+        expand(board(before[i], 0), a[cur][i - g]);
+      for (size_t i = g - std::min(g, group); i < std::min(g, n); i++) {
+        afterstates& e = a[prev][i % group];
+        collect(e);
+        size_t best = argmax(e.value, e.value + 4);
+        opcode[i] = e.reward[best] == -1 ? -1 : int(best);
+        if (value) value[i] = opcode[i] == -1 ? 0 : e.value[best];
+      }
     }
+    if (accesses) accesses->add(lookups);
   }
 
-  virtual action take_action(const board& b) {
-    auto weights = get_weights(b);
-    std::vector<weight::type> rewards;
-    rewards.reserve(4);
+ protected:
+  static constexpr size_t max_tuple = 8;
+  static constexpr size_t max_features = 64;
 
-    auto value = 0;
+  /**
+   * a single isomorphism of a pattern, i.e., cells to read and the table
+   */
+  struct feature {
+    std::array<uint8_t, max_tuple> cells;
+    unsigned size;
+    unsigned table;
+    bool gather;  // whether this and the next 7 features can be gathered
+  };
+  typedef std::array<weight::type*, max_features> weights_t;
 
-#pragma omp simd
-    for (size_t i = 0; i < weights.size(); ++i) value += *weights[i];
+  /**
+   * the four afterstates of a state and their evaluations, see evaluate()
+   */
+  struct afterstates {
+    board after[4];
+    board::reward reward[4];
+    unsigned stage[4];
+    alignas(32) uint32_t idx[4][max_features];
+    float value[4];
+    unsigned cached;  // the afterstates whose values are found in the cache
+    uint32_t generation;  // of the cache before the weights are read
+  };
 
-    for (int i = 0; i < 4; ++i) {
-      board _b(b);
-      auto _r = _b.slide(i);
+  /**
+   * the code paths of sum_weights, selected by "simd=scalar|avx2|avx512", or
+   * "simd=auto" (by default) for avx2 if the CPU supports it, since avx512
+   * gathers fetch no more weights per cycle than those of avx2
+   * the sums of the paths may differ in the last bits
+   */
+  enum simd_path { scalar, avx2, avx512 };
+  static bool supports(simd_path path) {
+#ifdef __x86_64__
+    if (path == avx512) return __builtin_cpu_supports("avx512f");
+    if (path == avx2) return __builtin_cpu_supports("avx2");
+#endif
+    return path == scalar;
+  }
 
-      if (_r == -1) {
-        rewards.push_back(std::numeric_limits<float>::lowest());
-        continue;
-      }
+  /**
+   * the table of features[i] in the given stage
+   */
+  size_t table(size_t i, unsigned s) const {
+    return features[i].table * stages() + s;
+  }
+
+  /**
+   * note that the weights have changed, e.g., by any of the copies, so that
+   * the values computed from the old ones are outdated, see generations()
+   */
+  void invalidate() {
+    generation->fetch_add(1, std::memory_order_relaxed);
+    if (cache) cache->invalidate();
+  }
+  /**
+   * the number of changes of the weights, starting from 1, e.g., to tag the
+   * values computed from them
+   */
+  uint32_t generations() const {
+    return generation->load(std::memory_order_relaxed);
+  }
+
+  board::reward reward_fn(board::reward& r) {
+    return 1 << static_cast<int>(std::floor(std::log(r + 1))) << 5;
+  }
+
+  /**
+   * compute the table indices of all the features in a single pass over the
+   * board, where idx[i] is the index of features[i] in net[features[i].table]
+   */
+  void get_indices(const board& b, uint32_t* idx) const {
+    if (specialized) return specialized(b.raw(), idx);
+
+    uint8_t cell[16];
+    board::bits raw = b.raw();
+    for (unsigned i = 0; i < 16; i++) cell[i] = (raw >> (i << 2)) & 0x0fu;
+
+    for (size_t i = 0; i < features.size(); i++) {
+      const feature& f = features[i];
+      uint32_t index = 0;
+      for (unsigned k = 0; k < f.size; k++)
+        index = (index << 4) | cell[f.cells[k]];
+      idx[i] = index;
+    }
+  }
 
-      auto _w = get_weights(_b);
-      float _v = 0;
-      for (auto& w : _w) _v += *w;
+  /**
+   * look up the weights of all the features
+   */
+  void get_weights(const board& b, weights_t& w) {
+    uint32_t idx[max_features];
+    get_indices(b, idx);
+    unsigned s = stage(b);
+    if (accesses) record(idx, s);
+    for (size_t i = 0; i < features.size(); i++) w[i] = &net[table(i, s)][idx[i]];
+  }
 
-      rewards.push_back(static_cast<float>(reward_fn(_r)) + _v);
+  /**
+   * count the lookups of the given feature indices and mark their entries as
+   * touched, see access_profile
+   */
+  void record(const uint32_t* idx, unsigned s) {
+    for (size_t i = 0; i < features.size(); i++) {
+      size_t t = table(i, s);
+      accesses->touch(t, idx[i]);
+      lookups[t]++;
     }
+  }
+
+  /**
+   * the estimated value of an afterstate
+   */
+  float estimate(const board& b) {
+    float v;
+    if (cache && cache->find(b.raw(), v)) return v;
+    uint32_t gen = cache ? cache->generations() : 0;
+    uint32_t idx[max_features];
+    get_indices(b, idx);
+    v = sum_weights(idx, stage(b));
+    if (cache) cache->store(b.raw(), v, gen);
+    return v;
+  }
+
+  /**
+   * sum up the weights of the given feature indices, by the code path chosen
+   * for the CPU at run time, see simd_path
+   */
+  float sum_weights(const uint32_t* idx, unsigned s) {
+    if (accesses) record(idx, s);
+    if (format == fp16) return sum_weights(net_fp16, idx, s);
+    if (format == int16) return sum_weights(net_int16, idx, s);
+    if (format == sparse) return sum_weights(net_sparse, idx, s);
+#ifdef __x86_64__
+    if (simd == avx512) return sum_avx512(idx, s);
+    if (simd == avx2) return sum_avx2(idx, s);
+#endif
+    return sum_scalar(idx, s, 0, 0);
+  }
 
-    size_t best_action = argmax(rewards.begin(), rewards.end());
-    auto r = board(b).slide(best_action);
+  /**
+   * add the weights of features[i] onward to v, one at a time
+   */
+  float sum_scalar(const uint32_t* idx, unsigned s, size_t i, float v) {
+    for (; i < features.size(); i++) v += net[table(i, s)][idx[i]];
+    return v;
+  }
 
-    // auto loss = (r == -1 ? 0 : rewards.at(best_action)) - value;
-    // for (auto w : weights) *w += alpha * loss;
+#ifdef __x86_64__
+  /**
+   * every group of 8 isomorphisms is fetched by a single gather
+   */
+  __attribute__((target("avx2"))) float sum_avx2(const uint32_t* idx,
+                                                 unsigned s) {
+    size_t i = 0;
+    __m256 acc = _mm256_setzero_ps();
+    while (i < features.size() && features[i].gather) {
+      __m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(idx + i));
+      const float* base = net[table(i, s)].data();
+      acc = _mm256_add_ps(acc, _mm256_i32gather_ps(base, index, 4));
+      i += 8;
+    }
+    return sum_scalar(idx, s, i, hsum(acc));
+  }
+  __attribute__((target("avx2"))) static float hsum(__m256 v) {
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(v),
+                             _mm256_extractf128_ps(v, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    return _mm_cvtss_f32(_mm_add_ss(half, _mm_movehdup_ps(half)));
+  }
 
-    //prev_reward = board(b).slide(best_action);
+  /**
+   * every two groups of 8 isomorphisms are fetched by a single gather, where
+   * the indices of the second group are offset by the distance between the
+   * tables, as long as it fits in the 32-bit indices
+   */
+  __attribute__((target("avx512f,avx2"))) float sum_avx512(const uint32_t* idx,
+                                                           unsigned s) {
+    size_t i = 0;
+    __m512 acc = _mm512_setzero_ps();
+    for (; i + 15 < features.size() && features[i].gather && features[i + 8].gather;
+         i += 16) {
+      const float* base = net[table(i, s)].data();
+      ptrdiff_t dist = net[table(i + 8, s)].data() - base;
+      if (std::abs(dist) >= (ptrdiff_t(1) << 31) - (ptrdiff_t(1) << 28)) break;
+      __m512i index = _mm512_loadu_si512(idx + i);
+      index = _mm512_mask_add_epi32(index, 0xff00, index,
+                                    _mm512_set1_epi32(int32_t(dist)));
+      acc = _mm512_add_ps(acc, _mm512_mask_i32gather_ps(_mm512_setzero_ps(),
+                                                        0xffff, index, base, 4));
+    }
+    __m256 rest = _mm256_setzero_ps();
+    for (; i < features.size() && features[i].gather; i += 8) {
+      __m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(idx + i));
+      const float* base = net[table(i, s)].data();
+      rest = _mm256_add_ps(rest, _mm256_i32gather_ps(base, index, 4));
+    }
+    // the masked forms, as the others trip -Wuninitialized in gcc 12
+    __m512d both = _mm512_castps_pd(acc);
+    __m256d zero = _mm256_setzero_pd();
+    rest = _mm256_add_ps(rest, _mm256_castpd_ps(_mm512_mask_extractf64x4_pd(zero, 0xf, both, 0)));
+    rest = _mm256_add_ps(rest, _mm256_castpd_ps(_mm512_mask_extractf64x4_pd(zero, 0xf, both, 1)));
+    return sum_scalar(idx, s, i, hsum(rest));
+  }
+#endif
+
+  /**
+   * sum up the weights of quantized tables, which are read directly
+   */
+  template <typename table_set>
+  float sum_weights(const table_set& tables, const uint32_t* idx,
+                    unsigned s) const {
+    float v = 0;
+    for (size_t i = 0; i < features.size(); i++)
+      v += tables[table(i, s)].get(idx[i]);
+    return v;
+  }
 
-    board _b(b);
-    _b.slide(best_action);
+  /**
+   * slide the state toward all four directions and evaluate the afterstates
+   * together: the indices are computed for the four boards at once, and all
+   * the weights are prefetched before they are summed up
+   * a.value[i] is the reward plus the value of a.after[i], or the lowest value
+   * if a.reward[i] is -1, i.e., the slide is illegal
+   */
+  void evaluate(const board& b, afterstates& a) {
+    expand(b, a);
+    collect(a);
+  }
 
-    if (r != -1) {
-      t.emplace_back(get_weights(_b), reward_fn(r));
+  /**
+   * the first half of evaluate(): slide, index and prefetch
+   * the weights of the afterstates found in the cache are not fetched, and
+   * neither are their indices computed by the specialized indexing unless
+   * they are recorded for training
+   */
+  void expand(const board& b, afterstates& a) const {
+    for (int d = 0; d < 4; d++) {
+      a.after[d] = b;
+      a.reward[d] = a.after[d].slide(d);
+      a.stage[d] = stage(a.after[d]);
+      if (cache && a.reward[d] != -1) cache->prefetch(a.after[d].raw());
     }
 
-    /*
-    if (board(b).slide(best_action) == -1) {
-      std::cerr << "Invalid action.\n";
-      auto idx = 0;
+    a.cached = 0;
+    a.generation = cache ? cache->generations() : 0;
+    for (int d = 0; d < 4 && cache; d++) {
+      if (a.reward[d] != -1 && cache->find(a.after[d].raw(), a.value[d]))
+        a.cached |= 1u << d;
+    }
 
-      std::cerr << "Best action: " << best_action << '\n';
+    if (specialized) {
+      unsigned skip = alpha ? 0 : a.cached;
+      for (int d = 0; d < 4; d++)
+        if (!(skip >> d & 1)) specialized(a.after[d].raw(), a.idx[d]);
+    } else {
+      batch_indices(a.after, a.idx);
+    }
 
-      std::cerr << "Current Board\n" << board(b) << '\n';
+    for (int d = 0; d < 4; d++) {
+      if (a.reward[d] == -1 || (a.cached >> d & 1)) continue;
+      if (format == float32) prefetch(net, a.idx[d], a.stage[d]);
+      if (format == fp16) prefetch(net_fp16, a.idx[d], a.stage[d]);
+      if (format == int16) prefetch(net_int16, a.idx[d], a.stage[d]);
+      if (format == sparse) prefetch(net_sparse, a.idx[d], a.stage[d]);
+    }
+  }
 
-      for (auto& r : rewards) {
-        std::cerr << "reward " << idx << ": " << r;
-        std::cerr << " | actual reward :" << board(b).slide(idx) << '\n';
-        ++idx;
+  /**
+   * the second half of evaluate(): sum up the prefetched weights
+   */
+  void collect(afterstates& a) {
+    for (int d = 0; d < 4; d++) {
+      if (a.reward[d] == -1) {
+        a.value[d] = std::numeric_limits<float>::lowest();
+        continue;
       }
+      float v = a.value[d];  // the cached value, if any
+      if (!(a.cached >> d & 1)) {
+        v = sum_weights(a.idx[d], a.stage[d]);
+        if (cache) cache->store(a.after[d].raw(), v, a.generation);
+      }
+      a.value[d] = static_cast<float>(reward_fn(a.reward[d])) + v;
+    }
+  }
 
-      std::cin >> idx;
+  template <typename table_set>
+  void prefetch(const table_set& tables, const uint32_t* idx, unsigned s) const {
+    for (size_t i = 0; i < features.size(); i++)
+      __builtin_prefetch(&tables[table(i, s)][idx[i]]);
+  }
+  void prefetch(const std::vector<sparse_weight>& tables, const uint32_t* idx,
+                unsigned s) const {
+    for (size_t i = 0; i < features.size(); i++)
+      __builtin_prefetch(tables[table(i, s)].address(idx[i]));
+  }
+
+  /**
+   * compute the indices of the four boards together by the generic loop
+   */
+  void batch_indices(const board after[4], uint32_t idx[4][max_features]) const {
+    uint32_t cell[16][4];
+    for (int d = 0; d < 4; d++) {
+      board::bits raw = after[d].raw();
+      for (unsigned i = 0; i < 16; i++) cell[i][d] = (raw >> (i << 2)) & 0x0fu;
     }
-    */
 
-    return r == -1 ? action() : action::slide(best_action);
+    for (size_t i = 0; i < features.size(); i++) {
+      const feature& f = features[i];
+      uint32_t index[4] = {0, 0, 0, 0};
+      for (unsigned k = 0; k < f.size; k++)
+        for (int d = 0; d < 4; d++) index[d] = (index[d] << 4) | cell[f.cells[k]][d];
+      for (int d = 0; d < 4; d++) idx[d][i] = index[d];
+    }
   }
 
  private:
-  std::vector<std::vector<unsigned>> encodings;
+  /**
+   * move weight i of table t by the error 'loss', at the rate of alpha, or
+   * alpha * |E| / A with temporal coherence, which is 1 before any error
+   */
+  void learn(size_t t, uint32_t i, float loss) {
+    float rate = alpha;
+    if (coherent) {
+      float& e = tc_e[t][i];
+      float& a = tc_a[t][i];
+      if (a != 0) rate *= std::abs(e) / a;
+      update(&e, loss);
+      update(&a, std::abs(loss));
+    }
+    update(&net[t][i], rate * loss);
+    if (remote) deltas.push_back({unsigned(t), i, rate * loss});
+  }
+
+  /**
+   * remove the patterns before others are set, except those given by the
+   * loaded weight file, which the new ones are checked against
+   */
+  void clear_patterns() {
+    features.clear();
+    shapes = 0;
+    patterns.resize(stored);
+    specialized = nullptr;
+  }
+
+  std::vector<feature> features;
+  void (*specialized)(board::bits raw, uint32_t* idx);  // or nullptr
+  size_t shapes;
+  size_t stored;  // the patterns given by the loaded weight file
   size_t tuple_n;
   unsigned entity_size;
   board::reward prev_reward;
-  std::vector<std::pair<std::vector<weight::type*>, float>> t;
 
-  board::reward reward_fn(board::reward& r) {
-    return 1 << static_cast<int>(std::floor(std::log(r + 1))) << 5;
+  // the trajectory of the current episode, where step i holds the feature
+  // indices of its afterstate in trace[i * features.size()] onward, and the
+  // stage of the afterstate in trace_stage[i]
+  std::vector<uint32_t> trace;
+  std::vector<uint8_t> trace_stage;
+  std::vector<float> rewards;
+
+  // the connection to the parameter server shared by the copies, and the
+  // updates not yet pushed
+  std::shared_ptr<ps_client> remote;
+  std::vector<ps_delta> deltas;
+  size_t sync;
+  size_t episodes;
+
+  // the learning rule: "lambda=L" for TD(lambda), "tc=1" for temporal
+  // coherence, where the rate of a weight is alpha * |E| / A with E and A the
+  // sum of its errors and of their absolute values, and "delay=K" for the
+  // errors kept in 'pending' and applied every K episodes
+  float lambda;
+  bool coherent;
+  size_t delay;
+  size_t delayed;
+  std::vector<ps_delta> pending;
+  std::vector<weight> tc_e;  // shared by the copies as the tables are
+  std::vector<weight> tc_a;
+
+  // the values of the afterstates for the current weights, see value_cache,
+  // and the generation of the weights shared by the copies, see invalidate()
+  std::shared_ptr<value_cache> cache;
+  std::shared_ptr<std::atomic<uint32_t>> generation;
+  simd_path simd;
+
+  // the access profile shared by the copies, and the lookups of each table
+  // not yet added to it
+  std::shared_ptr<access_profile> accesses;
+  std::vector<uint64_t> lookups;
+};
+
+/**
+ * slider searching with expectimax over its own slides and the placements of
+ * the environment, where the leaves are evaluated by the n-tuple network
+ *
+ * "depth=N" is the maximum search depth in slides, "time=T" is the time budget
+ * per move in ms (0 for no limit), and "tt=B" sets the transposition table to
+ * 2^B entries; the search iteratively deepens until either limit is reached
+ */
+class expectimax_slider : public ntuple_slider {
+ public:
+  expectimax_slider(const std::string& args = "")
+      : ntuple_slider("name=expectimax role=slider " + args),
+        depth(2),
+        budget(0),
+        nodes(0),
+        timeout(false) {
+    if (meta.find("depth") != meta.end()) depth = int(meta["depth"]);
+    if (meta.find("time") != meta.end()) budget = int(meta["time"]);
+    unsigned bits = 20;
+    if (meta.find("tt") != meta.end()) bits = int(meta["tt"]);
+    tt.resize(size_t(1) << bits);
+  }
+
+  virtual action take_action(const board& b) {
+    deadline = std::chrono::steady_clock::now() +
+               std::chrono::milliseconds(budget);
+    timeout = false;
+    int best = -1;
+    for (unsigned d = 1; d <= std::max(depth, 1u) && !timeout; d++) {
+      int op = -1;
+      float value = std::numeric_limits<float>::lowest();
+      for (int i = 0; i < 4; i++) {
+        board after(b);
+        board::reward r = after.slide(i);
+        if (r == -1) continue;
+        float v = reward_fn(r) + expect(after, d - 1);
+        if (v > value) op = i, value = v;
+      }
+      if (!timeout || d == 1) best = op;
+    }
+    return best == -1 ? action() : action::slide(best);
+  }
+
+ protected:
+  /**
+   * the best value of a state before sliding, or 0 if the game is over
+   */
+  float maximize(const board& before, unsigned d) {
+    float value = std::numeric_limits<float>::lowest();
+    if (d == 1) {
+      // the sibling leaves are evaluated together, see evaluate()
+      afterstates a;
+      evaluate(before, a);
+      value = *std::max_element(a.value, a.value + 4);
+      return value != std::numeric_limits<float>::lowest() ? value : 0;
+    }
+    for (int i = 0; i < 4; i++) {
+      board after(before);
+      board::reward r = after.slide(i);
+      if (r == -1) continue;
+      value = std::max(value, reward_fn(r) + expect(after, d - 1));
+    }
+    return value != std::numeric_limits<float>::lowest() ? value : 0;
   }
 
-  std::vector<weight::type*> get_weights(const board& b) {
-    std::vector<weight::type*> w;
-    w.reserve(tuple_n);
+  /**
+   * the expected value of an afterstate over all possible placements
+   */
+  float expect(const board& after, unsigned d) {
+    if (d == 0 || out_of_time()) return estimate(after);
 
-    for (auto i = 0; i < encodings.size(); ++i) {
-      const auto enc = encodings.at(i);
-      uint32_t idx = 0;
+    entry& e = tt[after.hash() & (tt.size() - 1)];
+    uint32_t gen = generations();
+    if (e.key == after.hash() && e.generation == gen && e.depth >= d)
+      return e.value;
 
-      for (auto& e : enc) {
-        idx = (idx << 4) | b(e);
+    unsigned bag = after.bag(1) + after.bag(2) + after.bag(3);
+    float sum = 0, prob = 0;
+    for (int pos : random_placer::spaces(after.last())) {
+      if (after(pos) != 0) continue;
+      for (board::cell tile = 1; tile <= 3; tile++) {
+        if (after.hint() ? after.hint() != tile : after.bag(tile) == 0)
+          continue;
+        float p = after.hint() ? 1.0f : float(after.bag(tile)) / bag;
+        board drawn(after);
+        if (!drawn.hint()) drawn.extract_hint_from_bag(tile);
+        unsigned left = drawn.bag(1) + drawn.bag(2) + drawn.bag(3);
+        for (board::cell hint = 1; hint <= 3; hint++) {
+          if (drawn.bag(hint) == 0) continue;
+          board next(after);
+          if (next.place(pos, tile, hint) == -1) continue;
+          float q = d > 1 ? float(drawn.bag(hint)) / left : 1.0f;
+          sum += p * q * maximize(next, d);
+          prob += p * q;
+          if (d == 1) break;  // the next hint does not affect the leaves
+        }
       }
-
-      w.push_back(&net[i % 2][idx]);
     }
+    float value = prob ? sum / prob : estimate(after);
 
-    return w;
+    if (!timeout) e = {after.hash(), value, d, gen};
+    return value;
   }
+
+  bool out_of_time() {
+    if (budget == 0 || timeout || (++nodes & 0xff)) return timeout;
+    return timeout = std::chrono::steady_clock::now() > deadline;
+  }
+
+ private:
+  /**
+   * a searched afterstate, valid only for the weights of its generation, so
+   * that the table is outdated whenever the weights change, e.g., by the
+   * training of any copy, or by a pull from the parameter server
+   */
+  struct entry {
+    board::data key;
+    float value;
+    unsigned depth;
+    uint32_t generation;  // 0 for an empty entry, which matches nothing
+  };
+
+  unsigned depth;
+  unsigned budget;
+  std::vector<entry> tt;  // the transposition table
+  std::chrono::steady_clock::time_point deadline;
+  size_t nodes;
+  bool timeout;
 };
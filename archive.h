@@ -0,0 +1,166 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * archive.h: Compact binary file of episodes with random access
+ *
+ * Author: Theory of Computer Games
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "episode.h"
+#include "utils.h"
+
+/**
+ * layout of an archive (little-endian)
+ *
+ * "threesep" (version:uint32)
+ * (record-size:varint) (record) ... see episode::encode
+ * (record-offset:uint64) ... (records:uint64) "threesix"
+ *
+ * the index at the end is written when the archive is closed; an archive
+ * without it, e.g., from an interrupted run, is indexed by scanning records
+ */
+struct archive {
+  static constexpr char magic[8] = {'t', 'h', 'r', 'e', 'e', 's', 'e', 'p'};
+  static constexpr char index_magic[8] = {'t', 'h', 'r', 'e', 'e', 's', 'i', 'x'};
+  static constexpr uint32_t version = 1;
+  static constexpr size_t header_size = sizeof(magic) + sizeof(version);
+
+  static bool is_archive(const std::string& path) {
+    char head[sizeof(magic)] = {};
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    in.read(head, sizeof(head));
+    return in && std::equal(head, head + sizeof(head), magic);
+  }
+};
+
+class archive_writer {
+ public:
+  archive_writer(const std::string& path)
+      : out(path, std::ios::out | std::ios::binary | std::ios::trunc),
+        offset(archive::header_size) {
+    out.write(archive::magic, sizeof(archive::magic));
+    out.write(reinterpret_cast<const char*>(&archive::version),
+              sizeof(archive::version));
+  }
+  ~archive_writer() {
+    for (uint64_t off : index)
+      out.write(reinterpret_cast<const char*>(&off), sizeof(off));
+    uint64_t size = index.size();
+    out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    out.write(archive::index_magic, sizeof(archive::index_magic));
+  }
+
+  void write(const episode& ep) {
+    record.clear();
+    ep.encode(record);
+    head.clear();
+    put_varint(head, record.size());
+    out.write(head.data(), head.size());
+    out.write(record.data(), record.size());
+    index.push_back(offset);
+    offset += head.size() + record.size();
+  }
+  void flush() { out.flush(); }
+
+ private:
+  std::ofstream out;
+  std::vector<uint64_t> index;
+  uint64_t offset;
+  std::string head, record;
+};
+
+class archive_reader {
+ public:
+  archive_reader(const std::string& path)
+      : in(path, std::ios::in | std::ios::binary), next(0) {
+    if (!archive::is_archive(path)) in.setstate(std::ios::failbit);
+    if (in) load_index();
+  }
+
+  operator bool() const { return !in.fail(); }
+  size_t size() const { return index.size(); }
+
+  /**
+   * position the reader at the i-th episode
+   */
+  void seek(size_t i) { next = i; }
+
+  /**
+   * read the next episode, return false if there is none
+   */
+  bool read(episode& ep) {
+    if (next >= index.size()) return false;
+    in.clear();
+    in.seekg(index[next++]);
+    return read_record() && ep.decode(buf.data(), buf.data() + buf.size());
+  }
+
+  /**
+   * read up to n episodes from the current position
+   */
+  std::vector<episode> read(size_t n) {
+    std::vector<episode> eps;
+    eps.reserve(std::min(n, size() - std::min(next, size())));
+    for (episode ep; eps.size() < n && read(ep);) eps.push_back(std::move(ep));
+    return eps;
+  }
+
+ private:
+  void load_index() {
+    in.seekg(0, std::ios::end);
+    uint64_t end = in.tellg(), size = 0;
+    char tail[sizeof(archive::index_magic)] = {};
+    if (end >= archive::header_size + sizeof(size) + sizeof(tail)) {
+      in.seekg(end - sizeof(tail));
+      in.read(tail, sizeof(tail));
+      in.seekg(end - sizeof(tail) - sizeof(size));
+      in.read(reinterpret_cast<char*>(&size), sizeof(size));
+    }
+    uint64_t table = end - sizeof(tail) - sizeof(size) - size * sizeof(uint64_t);
+    if (in && std::equal(tail, tail + sizeof(tail), archive::index_magic) &&
+        table >= archive::header_size && table < end) {
+      index.resize(size);
+      in.seekg(table);
+      in.read(reinterpret_cast<char*>(index.data()), size * sizeof(uint64_t));
+      return;
+    }
+
+    // no valid index, so the records are scanned until the first broken one
+    in.clear();
+    uint64_t off = archive::header_size;
+    episode ep;
+    for (in.seekg(off); off < end && read_record(); off = in.tellg()) {
+      if (!ep.decode(buf.data(), buf.data() + buf.size())) break;
+      index.push_back(off);
+    }
+    in.clear();
+  }
+
+  bool read_record() {
+    char head[10];
+    size_t n = 0;
+    uint64_t size = 0;
+    for (int ch; n < sizeof(head) && (ch = in.get()) != EOF;) {
+      head[n++] = char(ch);
+      if (ch < 0x80) break;
+    }
+    const char* p = head;
+    if (!get_varint(p, head + n, size)) return false;
+    buf.resize(size);
+    in.read(&buf[0], size);
+    return bool(in);
+  }
+
+  std::ifstream in;
+  std::vector<uint64_t> index;
+  size_t next;
+  std::string buf;
+};
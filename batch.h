@@ -0,0 +1,238 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * batch.h: Simulator playing many games in lockstep
+ *
+ * Author: Theory of Computer Games
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "action.h"
+#include "agent.h"
+#include "board.h"
+#include "episode.h"
+
+/**
+ * play 'width' independent games at once with an n-tuple slider and the rules
+ * of random_placer, where the games are stored structure-of-arrays
+ *
+ * every round places a tile on all the boards waiting for the environment,
+ * and then slides all the boards waiting for the slider, whose afterstates
+ * are evaluated together by ntuple_slider::take_actions, so that the weights
+ * of many games are fetched from the memory at the same time
+ *
+ * the weights are frozen, i.e., the slider should have alpha=0
+ * a finished game is replayed into an episode for the statistics, where the
+ * time of every round is shared by the games played in it
+ */
+class batch_simulator {
+ public:
+  batch_simulator(ntuple_slider& slide, const random_placer& place,
+                  size_t width)
+      : slide(slide),
+        tag(slide.name() + ":" + place.name()),
+        slide_name(slide.name()),
+        place_name(place.name()),
+        width(std::max(width, size_t(1))),
+        tiles(this->width),
+        infos(this->width),
+        seed(place.seed()),
+        engines(this->width),
+        index(this->width),
+        clock(this->width),
+        charged(this->width),
+        started(this->width),
+        moves(this->width),
+        live(this->width) {}
+
+  /**
+   * play the games [first, last), where report(episode&& game, size_t n) is
+   * called with every finished game n, in the order they are finished
+   * game n is placed by random_agent::episode_engine(seed, n), so the games
+   * are the same as those played by threes.cpp without batches
+   */
+  template <typename function>
+  void run(size_t first, size_t last, function report) {
+    slide.open_episode("~:" + place_name);
+    size_t opened = first, running = 0;
+    for (size_t i = 0; i < width && opened < last; i++, running++)
+      open(i, opened++);
+
+    std::vector<uint32_t> list;
+    std::vector<uint8_t> done;
+    std::vector<board::bits> before;
+    std::vector<int> opcode;
+    list.reserve(width);
+    done.reserve(width);
+    before.reserve(width);
+    opcode.reserve(width);
+
+    auto close = [&](uint32_t i, const std::string& win) {
+      report(replay(i, win), index[i]);
+      if (opened < last) {
+        open(i, opened++);
+      } else {
+        live[i] = false;
+        running--;
+      }
+    };
+
+    while (running) {
+      // the environment places a tile on every board waiting for it
+      list.clear();
+      for (uint32_t i = 0; i < width; i++)
+        if (live[i] && !slider_turn(i)) list.push_back(i);
+      done.assign(list.size(), false);
+      auto start = now();
+      for (size_t k = 0; k < list.size(); k++) done[k] = !place(list[k]);
+      charge(list, done, start);
+      for (size_t k = 0; k < list.size(); k++)
+        if (done[k]) close(list[k], slide_name);
+
+      // the slider slides every board waiting for it, all evaluated together
+      list.clear();
+      before.clear();
+      for (uint32_t i = 0; i < width; i++) {
+        if (!live[i] || !slider_turn(i)) continue;
+        list.push_back(i);
+        before.push_back(tiles[i]);
+      }
+      done.assign(list.size(), false);
+      opcode.resize(list.size());
+      start = now();
+      slide.take_actions(before.data(), before.size(), opcode.data());
+      for (size_t k = 0; k < list.size(); k++)
+        done[k] = !apply_slide(list[k], opcode[k]);
+      charge(list, done, start);
+      for (size_t k = 0; k < list.size(); k++)
+        if (done[k]) close(list[k], place_name);
+    }
+  }
+
+ private:
+  /**
+   * a move of a game, kept until the game is finished
+   */
+  struct played {
+    action code;
+    board::reward reward;
+    time_t time;
+  };
+
+  void open(uint32_t i, size_t n) {
+    board init;
+    tiles[i] = init.raw();
+    infos[i] = init.info();
+    engines[i] = random_agent::episode_engine(seed, n);
+    index[i] = n;
+    clock[i] = (mix64(n) & 1023) / 1024.0;  // a random phase of the ms ticks,
+    charged[i] = 0;  // so that the rounding is unbiased on average
+    started[i] = millisec();
+    moves[i].clear();  // the capacity is kept for the next games
+    live[i] = true;
+  }
+
+  /**
+   * the turns alternate as in episode::take_turns
+   */
+  bool slider_turn(uint32_t i) const {
+    size_t step = moves[i].size();
+    return step >= 9 && (step - 8) % 2;
+  }
+
+  /**
+   * place a tile by the rules of random_placer, return false if there is no
+   * space for it
+   */
+  bool place(uint32_t i) {
+    board b(tiles[i], infos[i]);
+    action::place move = random_placer::choose(b, engines[i]);
+    board::reward reward = move.apply(b);
+    if (reward == -1) return false;
+    tiles[i] = b.raw();
+    infos[i] = b.info();
+    moves[i].push_back({move, reward, 0});
+    return true;
+  }
+
+  /**
+   * apply a slide chosen by the slider, return false if there is none
+   */
+  bool apply_slide(uint32_t i, int op) {
+    if (op == -1) return false;
+    board b(tiles[i], infos[i]);
+    board::reward reward = b.slide(op);
+    tiles[i] = b.raw();
+    infos[i] = b.info();
+    moves[i].push_back({action::slide(op), reward, 0});
+    return true;
+  }
+
+  /**
+   * share the time since 'start' by the games which have moved, and set the
+   * time of their last moves in ms, carrying the remainders to the next moves
+   */
+  void charge(const std::vector<uint32_t>& list,
+              const std::vector<uint8_t>& done,
+              std::chrono::steady_clock::time_point start) {
+    size_t moved = std::count(done.begin(), done.end(), false);
+    if (moved == 0) return;
+    double share = std::chrono::duration<double, std::milli>(now() - start)
+                       .count() / moved;
+    for (size_t k = 0; k < list.size(); k++) {
+      if (done[k]) continue;
+      uint32_t i = list[k];
+      clock[i] += share;
+      time_t time = time_t(clock[i]) - charged[i];
+      charged[i] += time;
+      moves[i].back().time = time;
+    }
+  }
+
+  /**
+   * the episode of a finished game, won by 'win'
+   */
+  episode replay(uint32_t i, const std::string& win) {
+    episode game;
+    game.open_episode(tag, started[i]);
+    for (const played& mv : moves[i])
+      game.record_action(mv.code, mv.reward, mv.time);
+    game.state() = board(tiles[i], infos[i]);
+    game.close_episode(win, started[i] + charged[i]);
+    return game;
+  }
+
+  static std::chrono::steady_clock::time_point now() {
+    return std::chrono::steady_clock::now();
+  }
+  static time_t millisec() {
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+  }
+
+ private:
+  ntuple_slider& slide;
+  std::string tag;
+  std::string slide_name;
+  std::string place_name;
+  size_t width;
+
+  // the state of game i is (tiles[i], infos[i]), and its moves are moves[i]
+  std::vector<board::bits> tiles;
+  std::vector<board::data> infos;
+  unsigned seed;
+  std::vector<xoshiro256> engines;  // the placements of game i
+  std::vector<size_t> index;        // the episode played as game i
+  std::vector<double> clock;    // the time spent on the game in ms
+  std::vector<time_t> charged;  // the time recorded in its moves in ms
+  std::vector<time_t> started;
+  std::vector<std::vector<played>> moves;
+  std::vector<uint8_t> live;
+};
@@ -0,0 +1,350 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * bench.cpp: Micro and macro benchmarks of the hot paths
+ *
+ * Author: Theory of Computer Games
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "action.h"
+#include "agent.h"
+#include "batch.h"
+#include "board.h"
+#include "episode.h"
+#include "service.h"
+
+/**
+ * count the heap allocations of the whole program, by replacing every form of
+ * operator new and operator delete, so that all of them go through the same
+ * malloc and free; they are kept out of line, where gcc would otherwise see a
+ * malloc paired with an operator delete in the inlined callers
+ */
+static std::atomic<size_t> allocations(0);
+__attribute__((noinline)) static void* allocate(size_t size, size_t align) {
+  allocations++;
+  if (align <= alignof(std::max_align_t)) return std::malloc(size ?: 1);
+  return std::aligned_alloc(align, (size + align - 1) / align * align ?: align);
+}
+__attribute__((noinline)) static void deallocate(void* p) { std::free(p); }
+
+void* operator new(size_t size) {
+  if (void* p = allocate(size, 0)) return p;
+  throw std::bad_alloc();
+}
+void* operator new(size_t size, std::align_val_t align) {
+  if (void* p = allocate(size, size_t(align))) return p;
+  throw std::bad_alloc();
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return allocate(size, 0);
+}
+void* operator new(size_t size, std::align_val_t align,
+                   const std::nothrow_t&) noexcept {
+  return allocate(size, size_t(align));
+}
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new[](size_t size, std::align_val_t align) {
+  return operator new(size, align);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return allocate(size, 0);
+}
+void* operator new[](size_t size, std::align_val_t align,
+                     const std::nothrow_t&) noexcept {
+  return allocate(size, size_t(align));
+}
+void operator delete(void* p) noexcept { deallocate(p); }
+void operator delete(void* p, size_t) noexcept { deallocate(p); }
+void operator delete(void* p, std::align_val_t) noexcept { deallocate(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+  deallocate(p);
+}
+void operator delete(void* p, const std::nothrow_t&) noexcept { deallocate(p); }
+void operator delete(void* p, std::align_val_t,
+                     const std::nothrow_t&) noexcept {
+  deallocate(p);
+}
+void operator delete[](void* p) noexcept { deallocate(p); }
+void operator delete[](void* p, size_t) noexcept { deallocate(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { deallocate(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+  deallocate(p);
+}
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+  deallocate(p);
+}
+void operator delete[](void* p, std::align_val_t,
+                       const std::nothrow_t&) noexcept {
+  deallocate(p);
+}
+
+/**
+ * expose the internals of ntuple_slider to the benchmarks
+ */
+class bench_slider : public ntuple_slider {
+ public:
+  bench_slider(const std::string& args) : ntuple_slider(args) {}
+  using ntuple_slider::get_weights;
+  using ntuple_slider::weights_t;
+};
+
+struct result {
+  std::string name;
+  size_t ops;
+  double nanosec;
+  size_t allocs;
+};
+
+/**
+ * run f, which performs 'ops' operations, and record its cost
+ */
+template <typename function>
+result measure(const std::string& name, function f) {
+  size_t allocs = allocations;
+  auto start = std::chrono::steady_clock::now();
+  size_t ops = f();
+  auto stop = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+  return {name, ops, ns, allocations - allocs};
+}
+
+static volatile uint64_t sink;
+
+/**
+ * play one game in the same way as threes.cpp, return the number of moves
+ */
+static size_t play(episode& game, agent& slide, agent& place) {
+  slide.open_episode("~:" + place.name());
+  place.open_episode(slide.name() + ":~");
+  game.open_episode(slide.name() + ":" + place.name());
+  while (true) {
+    agent& who = game.take_turns(slide, place);
+    action move = who.take_action(game.state());
+    if (game.apply_action(move) != true) break;
+    if (who.check_for_win(game.state())) break;
+  }
+  agent& win = game.last_turns(slide, place);
+  game.close_episode(win.name());
+  slide.close_episode(win.name());
+  place.close_episode(win.name());
+  return game.step();
+}
+
+int main(int argc, const char* argv[]) {
+  std::string slide_args = "alpha=0.0025", place_args = "seed=0", json_path;
+  size_t iter = 1000000, games = 200;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    auto match_arg = [&](std::string flag) -> bool {
+      auto it = arg.find_first_not_of('-');
+      return arg.find(flag, it) == it;
+    };
+    auto next_opt = [&]() -> std::string {
+      auto it = arg.find('=') + 1;
+      return it ? arg.substr(it) : argv[++i];
+    };
+    if (match_arg("iter")) {
+      iter = std::stoull(next_opt());
+    } else if (match_arg("games")) {
+      games = std::stoull(next_opt());
+    } else if (match_arg("slide") || match_arg("play")) {
+      slide_args = next_opt();
+    } else if (match_arg("place") || match_arg("env")) {
+      place_args = next_opt();
+    } else if (match_arg("json")) {
+      json_path = next_opt();
+    }
+  }
+
+  bench_slider slide(slide_args);
+  slide.set_encoding({
+    {0, 1, 2, 4, 5, 6},
+    {4, 5, 6, 8, 9, 10}
+  }, 8);
+  random_placer place(place_args);
+
+  // collect the states met in real games as the inputs of the benchmarks
+  std::vector<board> befores, afters;
+  std::vector<action> places;
+  for (size_t n = 0; n < games / 10 + 1; n++) {
+    episode game;
+    play(game, slide, place);
+    board b;
+    for (action a : game.actions()) {
+      if (a.type() == action::place::type) {
+        afters.push_back(b);
+        places.push_back(a);
+      } else {
+        befores.push_back(b);
+      }
+      a.apply(b);
+    }
+  }
+  size_t mask = 1;
+  while (mask * 2 <= std::min(befores.size(), afters.size())) mask *= 2;
+  mask -= 1;
+
+  std::vector<result> results;
+  for (unsigned op = 0; op < 4; op++) {
+    results.push_back(measure(std::string("slide_") + "URDL"[op], [&] {
+      uint64_t sum = 0;
+      for (size_t i = 0; i < iter; i++) {
+        board b = befores[i & mask];
+        sum += b.slide(op) + b.raw();
+      }
+      sink = sum;
+      return iter;
+    }));
+  }
+  results.push_back(measure("place", [&] {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < iter; i++) {
+      board b = afters[i & mask];
+      action::place p(places[i & mask]);
+      sum += b.place(p.position(), p.tile(), p.hint()) + b.raw();
+    }
+    sink = sum;
+    return iter;
+  }));
+  results.push_back(measure("place_action", [&] {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < iter; i++) sum += place.take_action(afters[i & mask]);
+    sink = sum;
+    return iter;
+  }));
+  results.push_back(measure("get_weights", [&] {
+    bench_slider::weights_t w;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < iter; i++) {
+      slide.get_weights(befores[i & mask], w);
+      sum += reinterpret_cast<uintptr_t>(w[0]);
+    }
+    sink = sum;
+    return iter;
+  }));
+  {
+    // the afterstates of real games, in a cache of 2^16 sets
+    value_cache cache(16);
+    uint32_t gen = cache.generations();
+    results.push_back(measure("cache_store", [&] {
+      for (size_t i = 0; i < iter; i++)
+        cache.store(afters[i & mask].raw(), i, gen);
+      return iter;
+    }));
+    results.push_back(measure("cache_find", [&] {
+      float sum = 0, v;
+      for (size_t i = 0; i < iter; i++)
+        if (cache.find(afters[i & mask].raw(), v)) sum += v;
+      sink = sum;
+      return iter;
+    }));
+  }
+  results.push_back(measure("take_action", [&] {
+    uint64_t sum = 0;
+    size_t n = iter / 10;
+    for (size_t i = 0; i < n; i++) {
+      if (i % 1000 == 0) slide.open_episode();
+      sum += slide.take_action(befores[i & mask]);
+    }
+    sink = sum;
+    return n;
+  }));
+  {
+    // a trajectory of real length, updated repeatedly
+    episode game;
+    random_placer rp(place_args);
+    play(game, slide, rp);
+    slide.open_episode();
+    size_t len = std::min(befores.size(), game.step(action::slide::type));
+    for (size_t i = 0; i < len; i++) slide.take_action(befores[i]);
+    results.push_back(measure("close_episode", [&] {
+      size_t n = std::max<size_t>(iter / 10 / std::max<size_t>(len, 1), 1);
+      for (size_t i = 0; i < n; i++) slide.close_episode();
+      return n * len;
+    }));
+  }
+  results.push_back(measure("episode", [&] {
+    size_t moves = 0;
+    for (size_t n = 0; n < games; n++) {
+      episode game;
+      moves += play(game, slide, place);
+    }
+    return moves;
+  }));
+  results.push_back(measure("batch_episode", [&] {
+    // the same number of games, played 64 at a time in lockstep
+    size_t moves = 0;
+    batch_simulator sim(slide, place, 64);
+    sim.run(0, games, [&](episode&& game, size_t) { moves += game.step(); });
+    return moves;
+  }));
+
+  {
+    // the round trips to a daemon on a Unix socket, per board
+    std::string path = "/tmp/threes-bench-" + std::to_string(::getpid());
+    move_server server(path, slide, 1);
+    std::thread daemon(&move_server::run, &server);
+    // the socket appears at bind(), before listen(), so connect until the
+    // server accepts rather than wait for the file
+    int probe;
+    while ((probe = service::connect_to(path)) < 0) std::this_thread::yield();
+    ::close(probe);
+    move_client client(path);
+    std::vector<board::bits> raw;
+    for (const board& b : befores) raw.push_back(b.raw());
+    std::vector<service::move> moves(64);
+    results.push_back(measure("daemon_move", [&] {
+      size_t n = iter / 100;
+      for (size_t i = 0; i < n; i++)
+        client.query(&raw[i & mask], 1, moves.data());
+      return n;
+    }));
+    results.push_back(measure("daemon_batch", [&] {
+      size_t n = iter / 100, k = std::min<size_t>(64, mask + 1);
+      for (size_t i = 0; i < n; i += k)
+        client.query(&raw[i & mask & ~(k - 1)], k, moves.data());
+      return n;
+    }));
+    server.stop();
+    daemon.join();
+  }
+
+  std::cout << std::left << std::setw(16) << "benchmark" << std::right
+            << std::setw(12) << "ns/op" << std::setw(16) << "ops/s"
+            << std::setw(14) << "allocs/op" << std::endl;
+  for (const result& r : results) {
+    std::cout << std::left << std::setw(16) << r.name << std::right
+              << std::fixed << std::setprecision(2) << std::setw(12)
+              << (r.nanosec / r.ops) << std::setprecision(0) << std::setw(16)
+              << (r.ops * 1e9 / r.nanosec) << std::setprecision(3)
+              << std::setw(14) << (double(r.allocs) / r.ops) << std::endl;
+  }
+
+  if (json_path.size()) {
+    std::ofstream out(json_path, std::ios::out | std::ios::trunc);
+    out << "{\"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+      const result& r = results[i];
+      out << (i ? ", " : "") << "{\"name\": \"" << r.name << "\""
+          << ", \"ops\": " << r.ops
+          << ", \"ns_per_op\": " << (r.nanosec / r.ops)
+          << ", \"ops_per_sec\": " << (r.ops * 1e9 / r.nanosec)
+          << ", \"allocs_per_op\": " << (double(r.allocs) / r.ops) << "}";
+    }
+    out << "]}" << std::endl;
+  }
+  return 0;
+}
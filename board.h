@@ -8,14 +8,20 @@
  */
 
 #pragma once
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 #include <algorithm>
 #include <array>
 #include <cmath>
+#include <cstdint>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
 
 /**
- * array-based board for Threes!
+ * bitboard for Threes!
+ * each cell takes 4 bits of a 64-bit integer, cell (i) is at bits [4i, 4i+4)
  *
  * index (1-d form):
  *  (0)  (1)  (2)  (3)
@@ -32,25 +38,128 @@ class board {
   typedef uint64_t data;
   typedef uint64_t score;
   typedef int reward;
+  typedef uint64_t bits;
+
+  /**
+   * writable reference to a single cell of the bitboard
+   */
+  class reference {
+   public:
+    reference(board& b, unsigned i) : b(b), i(i) {}
+    operator cell() const { return b.at(i); }
+    reference& operator=(cell t) { return b.at(i, t), *this; }
+    reference& operator=(const reference& r) { return operator=(cell(r)); }
+
+   private:
+    board& b;
+    unsigned i;
+  };
+
+  /**
+   * read-only iterator over the 16 cells in 1-d order
+   */
+  class iterator {
+   public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef cell value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const cell* pointer;
+    typedef cell reference;
+
+    iterator(bits raw = 0, unsigned i = 0) : raw(raw), i(i) {}
+    cell operator*() const { return (raw >> (i << 2)) & 0x0fu; }
+    iterator& operator++() { return ++i, *this; }
+    iterator operator++(int) { return iterator(raw, i++); }
+    bool operator==(const iterator& it) const { return i == it.i; }
+    bool operator!=(const iterator& it) const { return i != it.i; }
+
+   private:
+    bits raw;
+    unsigned i;
+  };
 
  public:
-  board() : tile(), attr(0) { reset(); }
-  board(const grid& b, data v = 0) : tile(b), attr(v) {}
+  board() : tile(0), attr(0) { reset(); }
+  board(const grid& b, data v = 0) : tile(0), attr(v) {
+    for (unsigned i = 0; i < 16; i++) at(i, b[i / 4][i % 4]);
+  }
+  board(bits raw, data v) : tile(raw), attr(v) {}
   board(const board& b) = default;
   board& operator=(const board& b) = default;
 
-  operator grid&() { return tile; }
-  operator const grid&() const { return tile; }
-  row& operator[](unsigned i) { return tile[i]; }
-  const row& operator[](unsigned i) const { return tile[i]; }
-  cell& operator()(unsigned i) { return tile[i / 4][i % 4]; }
-  const cell& operator()(unsigned i) const { return tile[i / 4][i % 4]; }
+  operator grid() const {
+    grid g;
+    for (unsigned i = 0; i < 4; i++) g[i] = operator[](i);
+    return g;
+  }
+  row operator[](unsigned i) const {
+    return {at(i * 4 + 0), at(i * 4 + 1), at(i * 4 + 2), at(i * 4 + 3)};
+  }
+  reference operator()(unsigned i) { return {*this, i}; }
+  cell operator()(unsigned i) const { return at(i); }
+
+  iterator begin() const { return iterator(tile, 0); }
+  iterator end() const { return iterator(tile, 16); }
+
+  bits raw() const { return tile; }
+
+  /**
+   * whether any cell holds the tile (index value) t or a larger one
+   */
+  bool reaches(cell t) const {
+    bits add = (0x10 - (t & 0x0f)) * 0x0101010101010101ull;
+    bits lo = tile & 0x0f0f0f0f0f0f0f0full, hi = (tile >> 4) & 0x0f0f0f0f0f0f0f0full;
+    return ((lo + add) | (hi + add)) & 0x1010101010101010ull;
+  }
 
-  cell* begin() { return &(operator()(0)); }
-  const cell* begin() const { return &(operator()(0)); }
-  cell* end() { return begin() + 16; }
-  const cell* end() const { return begin() + 16; }
+  /**
+   * the empty cells, where bit (i) is set if cell (i) is empty
+   * the flags of the cells are packed by pext if the CPU supports BMI2,
+   * chosen at run time unless BMI2 is enabled at build time, e.g., make
+   * MARCH=native, where pext is inlined
+   */
+  unsigned empty() const {
+    bits e = tile | (tile >> 1);
+    e = ~(e | (e >> 2)) & 0x1111111111111111ull;
+#ifdef __BMI2__
+    return _pext_u64(e, 0x1111111111111111ull);
+#else
+#ifdef __x86_64__
+    if (bmi2()) return pack_bmi2(e);
+#endif
+    e = (e | (e >> 3)) & 0x0303030303030303ull;
+    e = (e | (e >> 6)) & 0x000f000f000f000full;
+    e = (e | (e >> 12)) & 0x000000ff000000ffull;
+    return (e | (e >> 24)) & 0xffffu;
+#endif
+  }
 
+#ifdef __x86_64__
+  /**
+   * whether the CPU supports BMI2, i.e., pext and pdep
+   */
+  static bool bmi2() {
+    static const bool supported = __builtin_cpu_supports("bmi2");
+    return supported;
+  }
+
+ private:
+  __attribute__((target("bmi2"))) static unsigned pack_bmi2(bits e) {
+    return _pext_u64(e, 0x1111111111111111ull);
+  }
+
+ public:
+#endif
+
+  /**
+   * 64-bit hash of the tiles and the attributes, e.g., for transposition tables
+   */
+  data hash() const {
+    data h = tile ^ (attr * 0x9e3779b97f4a7c15ull);
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+  }
   data info() const { return attr; }
   data info(data dat) {
     data old = attr;
@@ -59,6 +168,11 @@ class board {
   }
 
  private:
+  cell at(unsigned i) const { return (tile >> (i << 2)) & 0x0fu; }
+  void at(unsigned i, cell t) {
+    tile = (tile & ~(bits(0x0fu) << (i << 2))) | (bits(t & 0x0fu) << (i << 2));
+  }
+
   data info4(size_t i) const { return (info() >> (4 * i)) & 0x0fu; }
   data info4(size_t i, data dat) {
     data old = info4(i);
@@ -117,11 +231,11 @@ class board {
    */
   reward place(unsigned pos, cell tile, cell hint_tile) {
     data bak = info();
-    if (pos >= 16 || operator()(pos)) return -1;
+    if (pos >= 16 || at(pos)) return -1;
     if (hint() == 0 && !extract_hint_from_bag(tile)) return -1;
     if (hint() != tile) return info(bak), -1;
     if (!extract_hint_from_bag(hint_tile)) return info(bak), -1;
-    operator()(pos) = tile;
+    at(pos, tile);
     last(4);
     return itov(tile);
   }
@@ -155,45 +269,18 @@ class board {
     return r;
   }
 
-  reward slide_left() {
-    bool moved = false;
-    reward score = 0;
-    for (int r = 0; r < 4; r++) {
-      auto& row = tile[r];
-      for (int c = 1; c < 4; c++) {
-        auto& t0 = row[c - 1];
-        auto& t1 = row[c];
-        if (t0 == 0) {
-          t0 = t1;
-          t1 = 0;
-          moved |= (t0 != 0);
-        } else if (t1 != 0 &&
-                   ((t0 + t1 == 3) || (t0 == t1 && t0 >= 3 && t0 < 14))) {
-          t0 = std::max(t0, t1) + 1;
-          t1 = 0;
-          score += itov(t0) - itov(t0 - 1) * 2;
-          moved = true;
-        }
-      }
-    }
-    return (moved) ? score : -1;
-  }
-  reward slide_right() {
-    reflect_horizontal();
-    reward score = slide_left();
-    reflect_horizontal();
-    return score;
-  }
+  reward slide_left() { return slide_rows(lookup::table().left); }
+  reward slide_right() { return slide_rows(lookup::table().right); }
   reward slide_up() {
-    rotate_clockwise();
-    reward score = slide_right();
-    rotate_counterclockwise();
+    transpose();
+    reward score = slide_left();
+    transpose();
     return score;
   }
   reward slide_down() {
-    rotate_clockwise();
-    reward score = slide_left();
-    rotate_counterclockwise();
+    transpose();
+    reward score = slide_right();
+    transpose();
     return score;
   }
 
@@ -228,32 +315,98 @@ class board {
   }
 
   void reflect_horizontal() {
-    for (int r = 0; r < 4; r++) {
-      std::swap(tile[r][0], tile[r][3]);
-      std::swap(tile[r][1], tile[r][2]);
-    }
+    tile = ((tile & 0x000f000f000f000full) << 12) |
+           ((tile & 0x00f000f000f000f0ull) << 4) |
+           ((tile & 0x0f000f000f000f00ull) >> 4) |
+           ((tile & 0xf000f000f000f000ull) >> 12);
   }
 
   void reflect_vertical() {
-    for (int c = 0; c < 4; c++) {
-      std::swap(tile[0][c], tile[3][c]);
-      std::swap(tile[1][c], tile[2][c]);
-    }
+    tile = ((tile & 0x000000000000ffffull) << 48) |
+           ((tile & 0x00000000ffff0000ull) << 16) |
+           ((tile & 0x0000ffff00000000ull) >> 16) |
+           ((tile & 0xffff000000000000ull) >> 48);
   }
 
   void transpose() {
-    for (int r = 0; r < 4; r++) {
-      for (int c = r + 1; c < 4; c++) {
-        std::swap(tile[r][c], tile[c][r]);
+    bits t = tile;
+    t = (t & 0xf0f00f0ff0f00f0full) | ((t & 0x0000f0f00000f0f0ull) << 12) |
+        ((t & 0x0f0f00000f0f0000ull) >> 12);
+    t = (t & 0xff00ff0000ff00ffull) | ((t & 0x00ff00ff00000000ull) >> 24) |
+        ((t & 0x00000000ff00ff00ull) << 24);
+    tile = t;
+  }
+
+ private:
+  /**
+   * precomputed results of sliding a single 16-bit row to the left or right
+   * each entry holds the resulting row and the reward of the move
+   */
+  struct lookup {
+    struct entry {
+      uint16_t row;
+      uint32_t score;
+    };
+    std::array<entry, 65536> left;
+    std::array<entry, 65536> right;
+
+    lookup() {
+      for (uint32_t r = 0; r < 65536; r++) {
+        left[r] = slide_left(r);
+        entry e = slide_left(reverse(r));
+        right[r] = {reverse(e.row), e.score};
       }
     }
+    static uint16_t reverse(uint16_t r) {
+      return ((r & 0x000f) << 12) | ((r & 0x00f0) << 4) | ((r & 0x0f00) >> 4) |
+             ((r & 0xf000) >> 12);
+    }
+    static entry slide_left(uint16_t r) {
+      cell row[4];
+      for (int c = 0; c < 4; c++) row[c] = (r >> (c << 2)) & 0x0fu;
+      uint32_t score = 0;
+      for (int c = 1; c < 4; c++) {
+        auto& t0 = row[c - 1];
+        auto& t1 = row[c];
+        if (t0 == 0) {
+          t0 = t1;
+          t1 = 0;
+        } else if (t1 != 0 &&
+                   ((t0 + t1 == 3) || (t0 == t1 && t0 >= 3 && t0 < 14))) {
+          t0 = std::max(t0, t1) + 1;
+          t1 = 0;
+          score += itov(t0) - itov(t0 - 1) * 2;
+        }
+      }
+      uint16_t res = 0;
+      for (int c = 0; c < 4; c++) res |= row[c] << (c << 2);
+      return {res, score};
+    }
+
+    static const lookup& table() {
+      static const lookup t;
+      return t;
+    }
+  };
+
+  reward slide_rows(const std::array<lookup::entry, 65536>& move) {
+    bits next = 0;
+    reward score = 0;
+    for (int r = 0; r < 64; r += 16) {
+      const lookup::entry& e = move[(tile >> r) & 0xffffu];
+      next |= bits(e.row) << r;
+      score += e.score;
+    }
+    if (next == tile) return -1;
+    tile = next;
+    return score;
   }
 
  public:
   friend std::ostream& operator<<(std::ostream& out, const board& b) {
     out << "+------------------------+" << std::endl;
     for (int i = 0; i < 4; i++) {
-      auto& row = b[i];
+      auto row = b[i];
       out << "|" << std::dec;
       for (auto t : row) out << std::setw(6) << itot(t);
       out << "|";
@@ -275,14 +428,15 @@ class board {
   friend std::istream& operator>>(std::istream& in, board& b) {
     for (int i = 0; i < 16; i++) {
       while (!std::isdigit(in.peek()) && in.good()) in.ignore(1);
-      in >> b(i);
-      b(i) = ttoi(b(i));
+      cell t = 0;
+      in >> t;
+      b(i) = ttoi(t);
     }
     return in;
   }
 
  private:
-  grid tile;
+  bits tile;
   data attr;  // (#3-tile:4-bit) (#2-tile:4-bit) (#1-tile:4-bit)
               // (last_action:4-bit) (hint_tile:4-bit)
 };
@@ -0,0 +1,187 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * cache.h: Lock-free cache of the network values of afterstates
+ *
+ * Author: Theory of Computer Games
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+
+#include "board.h"
+#include "utils.h"
+
+/**
+ * a fixed-size, 4-way set-associative cache from boards to values, shared by
+ * the threads without locks
+ *
+ * a slot holds the value and its generation in one word, and the board xor
+ * that word in another, so that a slot torn by concurrent writes does not
+ * match any board; the entries of older generations are ignored, i.e., the
+ * whole cache is invalidated by invalidate() when the weights are changed
+ */
+class value_cache {
+ public:
+  /**
+   * a cache of 2^bits sets, 64 bytes each
+   */
+  value_cache(unsigned bits)
+      : mask((size_t(1) << bits) - 1),
+        sets(new set[mask + 1]()),
+        generation(1) {}
+
+  /**
+   * the cached value of the board, return false if there is none
+   */
+  bool find(board::bits raw, float& value) const {
+    counters& c = local();
+    counters::bump(c.lookups);
+    const set& s = sets[mix64(raw) & mask];
+    uint64_t gen = uint32_t(generation.load(std::memory_order_relaxed));
+    for (const slot& e : s.slots) {
+      uint64_t data = e.data.load(std::memory_order_relaxed);
+      if ((e.check.load(std::memory_order_relaxed) ^ data) != raw) continue;
+      if ((data >> 32) != gen) return false;
+      uint32_t bits = uint32_t(data);
+      std::memcpy(&value, &bits, sizeof(value));
+      counters::bump(c.hits);
+      return true;
+    }
+    return false;
+  }
+
+  /**
+   * fetch the set of the board ahead of find() and store()
+   */
+  void prefetch(board::bits raw) const {
+    __builtin_prefetch(&sets[mix64(raw) & mask]);
+  }
+
+  /**
+   * the current generation, to be read before a value is computed and then
+   * given to store() with it
+   */
+  uint32_t generations() const {
+    return uint32_t(generation.load(std::memory_order_acquire));
+  }
+
+  /**
+   * cache the value of the board computed in generation 'gen', replacing the
+   * same board or an outdated entry if any, or an entry chosen by the board
+   * otherwise; the value is dropped if the cache has been invalidated since,
+   * as it may have been computed from the old weights
+   */
+  void store(board::bits raw, float value, uint32_t gen) {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (generations() != gen) return;
+    uint64_t h = mix64(raw);
+    set& s = sets[h & mask];
+    slot* victim = nullptr;
+    for (slot& e : s.slots) {
+      uint64_t data = e.data.load(std::memory_order_relaxed);
+      bool same = (e.check.load(std::memory_order_relaxed) ^ data) == raw;
+      if (same || (data >> 32) != gen) {
+        victim = &e;
+        break;
+      }
+    }
+    if (!victim) {
+      victim = &s.slots[h >> 62];
+      counters::bump(local().evictions);
+    }
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    uint64_t data = (uint64_t(gen) << 32) | bits;
+    victim->data.store(data, std::memory_order_relaxed);
+    victim->check.store(raw ^ data, std::memory_order_relaxed);
+  }
+
+  /**
+   * outdate all the entries, e.g., after the weights are updated
+   */
+  void invalidate() { generation.fetch_add(1, std::memory_order_release); }
+
+  /**
+   * print the lookups of all the caches since the last report, e.g.,
+   *         cache   n = 512034, hit = 37.5%, evict = 1024
+   * nothing is printed if there are none
+   */
+  static void report(std::ostream& out) {
+    registry& r = registry::get();
+    std::lock_guard<std::mutex> lock(r.mtx);
+    static uint64_t last[3] = {};
+    uint64_t now[3] = {};
+    for (counters& c : r.threads) {
+      now[0] += c.lookups.load(std::memory_order_relaxed);
+      now[1] += c.hits.load(std::memory_order_relaxed);
+      now[2] += c.evictions.load(std::memory_order_relaxed);
+    }
+    uint64_t n = now[0] - last[0], hits = now[1] - last[1];
+    uint64_t evictions = now[2] - last[2];
+    std::copy(now, now + 3, last);
+    if (n == 0) return;
+
+    std::ios ff(nullptr);
+    ff.copyfmt(out);
+    out << std::fixed << std::setprecision(1);
+    out << "\tcache\tn = " << n << ", hit = " << (hits * 100.0 / n) << "%"
+        << ", evict = " << evictions << std::endl;
+    out.copyfmt(ff);
+  }
+
+ private:
+  struct slot {
+    std::atomic<uint64_t> check;  // the board xor data
+    std::atomic<uint64_t> data;   // the generation and the value
+  };
+  struct alignas(64) set {
+    slot slots[4];
+  };
+
+  /**
+   * counters of a single thread, only written by their owner, as those of
+   * profile::counters
+   */
+  struct counters {
+    std::atomic<uint64_t> lookups;
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> evictions;
+
+    counters() : lookups(0), hits(0), evictions(0) {}
+
+    static void bump(std::atomic<uint64_t>& v) {
+      v.store(v.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+  };
+  struct registry {
+    std::mutex mtx;
+    std::deque<counters> threads;
+
+    static registry& get() {
+      static registry r;
+      return r;
+    }
+  };
+  static counters& local() {
+    thread_local counters* c = nullptr;
+    if (c) return *c;
+    registry& r = registry::get();
+    std::lock_guard<std::mutex> lock(r.mtx);
+    r.threads.emplace_back();
+    return *(c = &r.threads.back());
+  }
+
+  size_t mask;
+  std::unique_ptr<set[]> sets;
+  std::atomic<uint64_t> generation;  // starts from 1, so no zeroed slot matches
+};
@@ -0,0 +1,118 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * checkpoint.h: Periodic snapshots written by a forked child process
+ *
+ * Author: Theory of Computer Games
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+/**
+ * take a checkpoint every 'every' episodes or 'interval' seconds (0 for never)
+ *
+ * a checkpoint forks the process and saves the snapshot in the child, where
+ * the memory is shared copy-on-write with the parent, so the caller goes on
+ * at once without copying the weight tables or waiting for the disk
+ * as only the calling thread is copied into the child, a checkpoint should be
+ * taken while the other threads are idle, e.g., between the parallel loops
+ * of the games, so that none of them holds a lock the child may need, e.g.,
+ * of malloc or of a stream
+ * a checkpoint is skipped rather than waited for if the previous one is still
+ * being written, and the last one is waited for by the destructor
+ */
+class checkpointer {
+ public:
+  checkpointer(size_t every = 0, unsigned interval = 0)
+      : every(every),
+        interval(interval),
+        child(-1),
+        last(std::chrono::steady_clock::now()),
+        taken(0),
+        skipped(0),
+        failed(0) {}
+  ~checkpointer() { reap(true); }
+
+  /**
+   * whether a checkpoint should be taken after the given episode
+   */
+  bool due(size_t step) const {
+    if (every && step % every == 0) return true;
+    return interval && std::chrono::steady_clock::now() - last >=
+                           std::chrono::seconds(interval);
+  }
+
+  /**
+   * run save() in a child process, return false if the checkpoint is skipped
+   * the other threads should be idle, see above
+   * save() should write its files atomically, e.g., to a temporary file then
+   * rename it, since the child may be killed together with the parent
+   * save() should report its failures and leave by _exit rather than exit,
+   * which would run the exit handlers and static destructors of the parent
+   */
+  template <typename function>
+  bool take(function save) {
+    last = std::chrono::steady_clock::now();
+    if (!reap(false)) {
+      skipped++;
+      return false;
+    }
+    std::cout.flush();  // the buffers would be written twice otherwise
+    std::cerr.flush();
+    pid_t pid = ::fork();
+    if (pid == 0) {
+      save();
+      ::_exit(0);
+    }
+    if (pid < 0) {
+      std::cerr << "checkpoint: cannot fork" << std::endl;
+      failed++;
+      return false;
+    }
+    child = pid;
+    taken++;
+    return true;
+  }
+
+  /**
+   * wait for the previous checkpoint to be written, if any
+   */
+  void wait() { reap(true); }
+
+  size_t checkpoints() const { return taken; }
+  size_t skips() const { return skipped; }
+  size_t failures() const { return failed; }
+
+ private:
+  /**
+   * collect the previous child, return false if it is still running
+   */
+  bool reap(bool wait) {
+    if (child < 0) return true;
+    int status = 0;
+    pid_t pid = ::waitpid(child, &status, wait ? 0 : WNOHANG);
+    if (pid == 0) return false;
+    if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      std::cerr << "checkpoint: failed to save" << std::endl;
+      failed++;
+    }
+    child = -1;
+    return true;
+  }
+
+  size_t every;
+  unsigned interval;
+  pid_t child;
+  std::chrono::steady_clock::time_point last;
+  size_t taken;
+  size_t skipped;
+  size_t failed;
+};
@@ -19,27 +19,45 @@
 #include "action.h"
 #include "agent.h"
 #include "board.h"
+#include "pool.h"
+#include "profile.h"
+#include "utils.h"
 
 class episode {
  public:
-  episode() : ep_state(initial_state()), ep_score(0), ep_time(0) {
-    ep_moves.reserve(10000);
-  }
+  episode()
+      : ep_state(initial_state()), ep_score(0), ep_time(0), ep_spent{0, 0} {}
 
  public:
   board& state() { return ep_state; }
   const board& state() const { return ep_state; }
   board::score score() const { return ep_score; }
 
-  void open_episode(const std::string& tag) { ep_open = {tag, millisec()}; }
-  void close_episode(const std::string& tag) { ep_close = {tag, millisec()}; }
+  void open_episode(const std::string& tag, time_t when = millisec()) {
+    ep_open = {tag, when};
+  }
+  void close_episode(const std::string& tag, time_t when = millisec()) {
+    ep_close = {tag, when};
+  }
   bool apply_action(action move) {
-    board::reward reward = move.apply(state());
+    board::reward reward;
+    {
+      PROFILE_SCOPE(profile::apply);
+      reward = move.apply(state());
+    }
     if (reward == -1) return false;
-    ep_moves.emplace_back(move, reward, millisec() - ep_time);
-    ep_score += reward;
+    record_action(move, reward, millisec() - ep_time);
     return true;
   }
+  /**
+   * record a move which has been applied elsewhere and took 'time' ms, e.g.,
+   * on the boards of batch_simulator; the state should be set at the end
+   */
+  void record_action(action move, board::reward reward, time_t time) {
+    ep_spent[is_slide(ep_moves.size())] += time;
+    ep_moves.emplace_back(move, reward, time);
+    ep_score += reward;
+  }
   agent& take_turns(agent& slide, agent& place) {
     ep_time = millisec();
     return step() >= 9 && (step() - 8) % 2 ? slide : place;
@@ -62,21 +80,14 @@ class episode {
   }
 
   time_t time(unsigned who = -1u) const {
-    time_t time = 0;
-    size_t i = 9;
     switch (who) {
       case action::place::type:
-        if (ep_moves.size())
-          for (i = 0; i < 8; i++) time += ep_moves[i].time;
-        // no break;
+        return ep_spent[0];
       case action::slide::type:
-        while (i < ep_moves.size()) time += ep_moves[i].time, i += 2;
-        break;
+        return ep_spent[1];
       default:
-        time = ep_close.when - ep_open.when;
-        break;
+        return ep_close.when - ep_open.when;
     }
-    return time;
   }
 
   std::vector<action> actions(unsigned who = -1u) const {
@@ -114,12 +125,52 @@ class episode {
       ep.ep_moves.emplace_back();
       moves >> ep.ep_moves.back();
       ep.ep_score += action(ep.ep_moves.back()).apply(ep.ep_state);
+      ep.ep_spent[is_slide(ep.ep_moves.size() - 1)] += ep.ep_moves.back().time;
     }
     std::getline(in, token, '|');
     std::stringstream(token) >> ep.ep_close;
     return in;
   }
 
+  /**
+   * append the episode to a buffer as a compact binary record
+   * the record holds both tags and timestamps, the number of moves, one byte
+   * per move for the actions, then varints for the rewards and the times
+   */
+  void encode(std::string& buf) const {
+    put_meta(buf, ep_open);
+    put_meta(buf, ep_close);
+    put_varint(buf, ep_moves.size());
+    for (const move& mv : ep_moves) buf.push_back(char(move::encode(mv.code)));
+    for (const move& mv : ep_moves) put_varint(buf, mv.reward);
+    for (const move& mv : ep_moves) put_varint(buf, mv.time);
+  }
+
+  /**
+   * decode a record made by encode and replay its actions on a new board
+   * return false if the record is malformed
+   */
+  bool decode(const char* p, const char* end) {
+    *this = {};
+    uint64_t size, v;
+    if (!get_meta(p, end, ep_open) || !get_meta(p, end, ep_close)) return false;
+    if (!get_varint(p, end, size) || size_t(end - p) < size) return false;
+    ep_moves.resize(size);
+    for (move& mv : ep_moves) {
+      mv.code = move::decode(*(p++));
+      mv.code.apply(ep_state);
+    }
+    for (move& mv : ep_moves) {
+      if (!get_varint(p, end, v)) return false;
+      ep_score += (mv.reward = v);
+    }
+    for (size_t i = 0; i < size; i++) {
+      if (!get_varint(p, end, v)) return false;
+      ep_spent[is_slide(i)] += (ep_moves[i].time = v);
+    }
+    return p == end;
+  }
+
  protected:
   struct move {
     action code;
@@ -129,6 +180,26 @@ class episode {
         : code(code), reward(reward), time(time) {}
 
     operator action() const { return code; }
+
+    /**
+     * pack an action into one byte
+     * place: (hint-1:2-bit) (tile-1:2-bit) (position:4-bit)
+     * slide: 0b110000 (opcode:2-bit)
+     */
+    static uint8_t encode(const action& a) {
+      if (a.type() == action::slide::type) return 0xc0 | (a.event() & 0b11);
+      action::place p(a);
+      if (a.type() != action::place::type || p.tile() - 1 > 2 ||
+          p.hint() - 1 > 2)
+        return 0xff;
+      return p.position() | ((p.tile() - 1) << 4) | ((p.hint() - 1) << 6);
+    }
+    static action decode(uint8_t b) {
+      if (b == 0xff) return action();
+      if ((b & 0xf0) == 0xc0) return action::slide(b & 0b11);
+      return action::place(b & 0x0f, ((b >> 4) & 0b11) + 1, (b >> 6) + 1);
+    }
+
     friend std::ostream& operator<<(std::ostream& out, const move& m) {
       out << m.code;
       if (m.reward) out << '[' << std::dec << m.reward << ']';
@@ -167,6 +238,26 @@ class episode {
     }
   };
 
+  static void put_meta(std::string& buf, const meta& m) {
+    put_varint(buf, m.tag.size());
+    buf.append(m.tag);
+    put_varint(buf, m.when);
+  }
+  static bool get_meta(const char*& p, const char* end, meta& m) {
+    uint64_t size, when;
+    if (!get_varint(p, end, size) || size_t(end - p) < size) return false;
+    m.tag.assign(p, size);
+    p += size;
+    if (!get_varint(p, end, when)) return false;
+    m.when = when;
+    return true;
+  }
+
+  /**
+   * whether the i-th move is a slide, see take_turns
+   */
+  static bool is_slide(size_t i) { return i >= 9 && i % 2; }
+
   static board initial_state() { return {}; }
   static time_t millisec() {
     auto now = std::chrono::system_clock::now().time_since_epoch();
@@ -176,8 +267,9 @@ class episode {
  private:
   board ep_state;
   board::score ep_score;
-  std::vector<move> ep_moves;
+  pooled_vector<move> ep_moves;  // recycled by the next episodes
   time_t ep_time;
+  time_t ep_spent[2];  // the time of the placements and of the slides
 
   meta ep_open;
   meta ep_close;
@@ -0,0 +1,144 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * ntuple.h: Compile-time specialized n-tuple pattern sets
+ *
+ * Author: Theory of Computer Games
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "board.h"
+
+/**
+ * the cell read by the isomorphism i (0 <= i < 8) of a pattern cell, which is
+ * the same as ntuple_slider::add_pattern, i.e., reflect horizontally if i >= 4
+ * and then rotate clockwise i % 4 times
+ */
+constexpr unsigned isomorphic_cell(unsigned cell, unsigned i) {
+  auto hflip = [](unsigned p) { return (p & ~3u) | (3 - (p & 3)); };
+  auto vflip = [](unsigned p) { return ((3 - (p >> 2)) << 2) | (p & 3); };
+  auto trans = [](unsigned p) { return ((p & 3) << 2) | (p >> 2); };
+  unsigned p = cell;
+  switch (i % 4) {
+    case 1: p = trans(hflip(p)); break;
+    case 2: p = hflip(vflip(p)); break;
+    case 3: p = trans(vflip(p)); break;
+  }
+  return i >= 4 ? hflip(p) : p;
+}
+
+/**
+ * a n-tuple pattern with its cells known at compile time, e.g.,
+ * tuple_pattern<0, 1, 2, 4, 5, 6>
+ */
+template <unsigned... cells>
+struct tuple_pattern {
+  static constexpr unsigned size = sizeof...(cells);
+  static constexpr size_t entries = size_t(1) << (4 * size);
+  static_assert(size >= 1 && size <= 8, "a pattern has 1 to 8 cells");
+
+  /**
+   * the index of the isomorphism i, fully unrolled over the cells
+   */
+  template <unsigned i>
+  static uint32_t index(board::bits raw) {
+    uint32_t v = 0;
+    ((v = (v << 4) | uint32_t((raw >> (4 * isomorphic_cell(cells, i))) & 0x0f)),
+     ...);
+    return v;
+  }
+
+  /**
+   * the indices of all the 8 isomorphisms
+   */
+  static void indices(board::bits raw, uint32_t* idx) {
+    idx[0] = index<0>(raw), idx[1] = index<1>(raw);
+    idx[2] = index<2>(raw), idx[3] = index<3>(raw);
+    idx[4] = index<4>(raw), idx[5] = index<5>(raw);
+    idx[6] = index<6>(raw), idx[7] = index<7>(raw);
+  }
+
+  static std::vector<unsigned> shape() { return {cells...}; }
+};
+
+/**
+ * a n-tuple network of the given patterns, where pattern i is looked up in
+ * table i by all its 8 isomorphisms, i.e., ntuple_slider::set_encoding(e, 8)
+ */
+template <typename... patterns>
+struct ntuple_network {
+  static constexpr size_t features = 8 * sizeof...(patterns);
+
+  /**
+   * the indices of all the features, in the same order as ntuple_slider
+   */
+  static void indices(board::bits raw, uint32_t* idx) {
+    size_t i = 0;
+    ((patterns::indices(raw, idx + i), i += 8), ...);
+  }
+
+  static std::vector<std::vector<unsigned>> encoding() {
+    return {patterns::shape()...};
+  }
+};
+
+/**
+ * the predefined pattern sets, which are selected by name, e.g., the slider
+ * argument "patterns=4x6"
+ */
+struct ntuple_registry {
+  struct entry {
+    std::string name;
+    std::vector<std::vector<unsigned>> encoding;
+    void (*indices)(board::bits raw, uint32_t* idx);
+  };
+
+  template <typename network>
+  static entry make(const std::string& name) {
+    return {name, network::encoding(), &network::indices};
+  }
+
+  static const std::vector<entry>& sets() {
+    static const std::vector<entry> s = {
+      make<ntuple_network<
+          tuple_pattern<0, 1, 2, 4, 5, 6>,
+          tuple_pattern<4, 5, 6, 8, 9, 10>>>("2x6"),
+      make<ntuple_network<
+          tuple_pattern<0, 1, 2, 3, 4, 5>,
+          tuple_pattern<4, 5, 6, 7, 8, 9>,
+          tuple_pattern<0, 1, 2, 4, 5, 6>,
+          tuple_pattern<4, 5, 6, 8, 9, 10>>>("4x6"),
+      make<ntuple_network<
+          tuple_pattern<0, 1, 2, 3>,
+          tuple_pattern<4, 5, 6, 7>,
+          tuple_pattern<0, 1, 4, 5>,
+          tuple_pattern<1, 2, 5, 6>,
+          tuple_pattern<5, 6, 9, 10>>>("5x4"),
+    };
+    return s;
+  }
+
+  /**
+   * the set of the given name, or nullptr if there is none
+   */
+  static const entry* find(const std::string& name) {
+    for (const entry& e : sets())
+      if (e.name == name) return &e;
+    return nullptr;
+  }
+
+  /**
+   * the set of the given encoding, or nullptr if it is not predefined
+   */
+  static const entry* find(const std::vector<std::vector<unsigned>>& e) {
+    for (const entry& s : sets())
+      if (s.encoding == e) return &s;
+    return nullptr;
+  }
+};
@@ -0,0 +1,125 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * pages.h: Huge-page and NUMA placement of large tables
+ *
+ * Author: Theory of Computer Games
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+
+/**
+ * how the memory of a table is allocated
+ *
+ * pages: "4k" (default), "thp" for transparent huge pages by madvise, or
+ *        "2m" and "1g" for hugetlbfs pages, which fall back to "thp" if none
+ *        are reserved (see /proc/sys/vm/nr_hugepages)
+ * numa:  "" (default, first touch), "interleave" for spreading the pages over
+ *        all nodes, "local" for the node of the allocating thread, or
+ *        "replicate" for one copy per node, see weight_agent
+ */
+class page_policy {
+ public:
+  enum page { normal, thp, huge_2m, huge_1g };
+  enum placement { first_touch, interleave, local, replicate };
+
+  page_policy() : pages(normal), numa(first_touch) {}
+  page_policy(const std::string& p, const std::string& n)
+      : pages(normal), numa(first_touch) {
+    if (p == "thp") pages = thp;
+    else if (p == "2m") pages = huge_2m;
+    else if (p == "1g") pages = huge_1g;
+    else if (p.size() && p != "4k") error("unknown pages " + p);
+    if (n == "interleave") numa = interleave;
+    else if (n == "local") numa = local;
+    else if (n == "replicate") numa = replicate;
+    else if (n.size()) error("unknown numa " + n);
+  }
+
+  bool is_default() const { return pages == normal && numa == first_touch; }
+  bool replicated() const { return numa == replicate; }
+
+  /**
+   * allocate zeroed memory of at least 'bytes' bytes, bound to 'node' if it
+   * is not -1; the memory is released with the last copy of the pointer
+   */
+  std::shared_ptr<void> allocate(size_t bytes, int node = -1) const {
+    size_t align = pages == huge_1g ? (1ul << 30) : (2ul << 20);
+    size_t len = std::max<size_t>((bytes + align - 1) / align * align, align);
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void* p = MAP_FAILED;
+    if (pages == huge_2m || pages == huge_1g) {
+      int size = pages == huge_1g ? 30 : 21;  // log2 of the page size
+      p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                 flags | MAP_HUGETLB | (size << MAP_HUGE_SHIFT), -1, 0);
+      if (p == MAP_FAILED) warn("no hugetlbfs pages reserved, use thp");
+    }
+    bool hugetlb = p != MAP_FAILED;
+    if (!hugetlb)
+      p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (p == MAP_FAILED) error("cannot allocate " + std::to_string(len) + " bytes");
+    if (!hugetlb && pages != normal) ::madvise(p, len, MADV_HUGEPAGE);
+
+    // the policy is applied before the pages are touched
+    int n = nodes();
+    unsigned long mask[16] = {};
+    if (node >= 0 && node < n && node < 1024) {
+      mask[node / 64] |= 1ul << (node % 64);
+      bind(p, len, mpol_bind, mask);
+    } else if (numa == interleave && n > 1) {
+      for (int i = 0; i < n && i < 1024; i++) mask[i / 64] |= 1ul << (i % 64);
+      bind(p, len, mpol_interleave, mask);
+    } else if (numa == local) {
+      bind(p, len, mpol_local, nullptr);
+    }
+    return std::shared_ptr<void>(p, [len](void* q) { ::munmap(q, len); });
+  }
+
+  /**
+   * the number of NUMA nodes, and the node of the calling thread
+   */
+  static int nodes() {
+    static int n = []() {
+      std::ifstream in("/sys/devices/system/node/online");
+      std::string s;
+      if (!(in >> s)) return 1;
+      return std::stoi(s.substr(s.find_last_of("-,") + 1)) + 1;
+    }();
+    return n;
+  }
+  static int current_node() {
+    unsigned cpu = 0, node = 0;
+    if (::syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) return 0;
+    return int(node);
+  }
+
+ private:
+  // the modes of mbind(2), as in <numaif.h> which needs libnuma to link
+  static constexpr int mpol_bind = 2;
+  static constexpr int mpol_interleave = 3;
+  static constexpr int mpol_local = 4;
+
+  static void bind(void* p, size_t len, int mode, const unsigned long* mask) {
+    if (::syscall(SYS_mbind, p, len, mode, mask, mask ? 1024 : 0, 0) != 0)
+      warn("cannot apply the numa policy");
+  }
+  static void warn(const std::string& what) {
+    std::cerr << "pages: " << what << std::endl;
+  }
+  [[noreturn]] static void error(const std::string& what) {
+    std::cerr << "pages: " << what << std::endl;
+    std::exit(-1);
+  }
+
+  page pages;
+  placement numa;
+};
@@ -0,0 +1,137 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * pool.h: Free lists of buffers recycled by the episodes
+ *
+ * Author: Theory of Computer Games
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/**
+ * free lists of vectors of T, so that the buffers of finished episodes are
+ * reused by the next ones rather than returned to the allocator
+ *
+ * every thread keeps up to 'local_max' buffers of its own without locks, and
+ * moves the rest to a shared depot, from which the threads refill when they
+ * run out, e.g., when the buffers are released by a thread other than the
+ * one using them
+ * a new buffer reserves the longest length released so far, so that the
+ * buffers rarely grow once the lengths of the episodes have been seen
+ */
+template <typename T>
+class buffer_pool {
+ public:
+  typedef std::vector<T> buffer;
+
+  /**
+   * an empty buffer, recycled if there is any
+   */
+  static buffer acquire() {
+    std::vector<buffer>& list = local();
+    if (list.empty()) refill(list);
+    if (list.empty()) {
+      buffer b;
+      b.reserve(std::max<size_t>(longest(), min_reserve));
+      return b;
+    }
+    buffer b = std::move(list.back());
+    list.pop_back();
+    return b;
+  }
+
+  /**
+   * give a buffer back for reuse, where some buffers are moved to the depot
+   * if the thread holds too many of them
+   */
+  static void release(buffer&& b) {
+    if (b.capacity() == 0) return;
+    size_t size = b.size();
+    std::atomic<size_t>& n = longest();
+    if (size > n.load(std::memory_order_relaxed))
+      n.store(size, std::memory_order_relaxed);  // a lost race is harmless
+    b.clear();
+    std::vector<buffer>& list = local();
+    if (list.size() >= local_max) spill(list);
+    list.push_back(std::move(b));
+  }
+
+ private:
+  static constexpr size_t local_max = 64;
+  static constexpr size_t min_reserve = 1024;
+
+  struct depot {
+    std::mutex mtx;
+    std::vector<buffer> list;
+  };
+  static depot& shared() {
+    static depot* d = new depot;  // never destroyed, as the threads may exit later
+    return *d;
+  }
+  static std::atomic<size_t>& longest() {
+    static std::atomic<size_t> n(0);
+    return n;
+  }
+  static std::vector<buffer>& local() {
+    thread_local std::vector<buffer> list;
+    if (list.capacity() == 0) list.reserve(local_max);
+    return list;
+  }
+
+  /**
+   * take up to half of 'local_max' buffers from the depot
+   */
+  static void refill(std::vector<buffer>& list) {
+    depot& d = shared();
+    std::lock_guard<std::mutex> lock(d.mtx);
+    while (d.list.size() && list.size() < local_max / 2) {
+      list.push_back(std::move(d.list.back()));
+      d.list.pop_back();
+    }
+  }
+  /**
+   * move half of the local buffers to the depot
+   */
+  static void spill(std::vector<buffer>& list) {
+    depot& d = shared();
+    std::lock_guard<std::mutex> lock(d.mtx);
+    while (list.size() > local_max / 2) {
+      d.list.push_back(std::move(list.back()));
+      list.pop_back();
+    }
+  }
+};
+
+/**
+ * a vector whose buffer comes from buffer_pool and goes back to it, where a
+ * copy is made in a recycled buffer, and an assignment by move swaps the
+ * buffers so that the old one is recycled with the source
+ */
+template <typename T>
+class pooled_vector : public std::vector<T> {
+ public:
+  typedef std::vector<T> base;
+
+  pooled_vector() : base(buffer_pool<T>::acquire()) {}
+  pooled_vector(const pooled_vector& v) : pooled_vector() {
+    this->assign(v.begin(), v.end());
+  }
+  pooled_vector(pooled_vector&& v) = default;
+  pooled_vector& operator=(const pooled_vector& v) {
+    this->assign(v.begin(), v.end());
+    return *this;
+  }
+  pooled_vector& operator=(pooled_vector&& v) {
+    this->swap(v);
+    return *this;
+  }
+  ~pooled_vector() {
+    buffer_pool<T>::release(std::move(static_cast<base&>(*this)));
+  }
+};
@@ -0,0 +1,140 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * profile.h: Optional per-phase timing with nanosecond resolution
+ *
+ * Author: Theory of Computer Games
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+
+/**
+ * the profiler is enabled by building with -DTHREES_PROFILE (make PROFILE=1)
+ * otherwise PROFILE_SCOPE expands to nothing and costs nothing
+ *
+ * each thread accumulates the elapsed time of every phase into its own
+ * log2-scaled histogram, and report() merges all of them
+ */
+#ifdef THREES_PROFILE
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(phase) \
+  profile::scope PROFILE_CONCAT(profile_scope_, __LINE__)(phase)
+#else
+#define PROFILE_SCOPE(phase)
+#endif
+
+namespace profile {
+
+enum phase { slide, place, apply, update, phases };
+static const char* const phase_name[phases] = {"slide", "place", "apply",
+                                               "update"};
+
+/**
+ * counters of a single thread, only written by their owner
+ */
+struct counters {
+  static const unsigned buckets = 48;  // bucket i holds [2^i, 2^(i+1)) ns
+  std::array<std::atomic<uint64_t>, phases> count;
+  std::array<std::atomic<uint64_t>, phases> nanosec;
+  std::array<std::array<std::atomic<uint64_t>, buckets>, phases> hist;
+
+  counters() : count(), nanosec(), hist() {}
+
+  void add(phase p, uint64_t ns) {
+    unsigned b = ns ? 63 - __builtin_clzll(ns) : 0;
+    bump(count[p], 1);
+    bump(nanosec[p], ns);
+    bump(hist[p][std::min(b, buckets - 1)], 1);
+  }
+  static void bump(std::atomic<uint64_t>& v, uint64_t n) {
+    v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+};
+
+struct registry {
+  std::mutex mtx;
+  std::deque<counters> threads;
+
+  static registry& get() {
+    static registry r;
+    return r;
+  }
+  static counters& local() {
+    thread_local counters* c = nullptr;
+    if (c) return *c;
+    registry& r = get();
+    std::lock_guard<std::mutex> lock(r.mtx);
+    r.threads.emplace_back();
+    return *(c = &r.threads.back());
+  }
+};
+
+/**
+ * measure the lifetime of the object as the given phase
+ */
+class scope {
+ public:
+  scope(phase p) : p(p), start(std::chrono::steady_clock::now()) {}
+  ~scope() {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start);
+    registry::local().add(p, ns.count());
+  }
+
+ private:
+  phase p;
+  std::chrono::steady_clock::time_point start;
+};
+
+/**
+ * print the phases measured since the last report, e.g.,
+ *         slide   n = 512034, avg = 612ns, p50 < 1024ns, p99 < 2048ns
+ */
+inline void report(std::ostream& out) {
+  registry& r = registry::get();
+  std::lock_guard<std::mutex> lock(r.mtx);
+  static uint64_t last_count[phases] = {}, last_nanosec[phases] = {};
+  static uint64_t last_hist[phases][counters::buckets] = {};
+
+  for (unsigned p = 0; p < phases; p++) {
+    uint64_t count = 0, nanosec = 0, hist[counters::buckets] = {};
+    for (counters& c : r.threads) {
+      count += c.count[p].load(std::memory_order_relaxed);
+      nanosec += c.nanosec[p].load(std::memory_order_relaxed);
+      for (unsigned b = 0; b < counters::buckets; b++)
+        hist[b] += c.hist[p][b].load(std::memory_order_relaxed);
+    }
+    uint64_t n = count - last_count[p], ns = nanosec - last_nanosec[p];
+    for (unsigned b = 0; b < counters::buckets; b++) {
+      uint64_t v = hist[b];
+      hist[b] -= last_hist[p][b];
+      last_hist[p][b] = v;
+    }
+    last_count[p] = count;
+    last_nanosec[p] = nanosec;
+    if (n == 0) continue;
+
+    out << "\t" << phase_name[p] << "\tn = " << n
+        << ", avg = " << (ns / n) << "ns";
+    const double quantile[] = {0.5, 0.9, 0.99};
+    const char* label[] = {"p50", "p90", "p99"};
+    uint64_t sum = 0;
+    for (unsigned q = 0, b = 0; q < 3; q++) {
+      while (b < counters::buckets && sum + hist[b] < quantile[q] * n)
+        sum += hist[b++];
+      out << ", " << label[q] << " < " << (uint64_t(2) << b) << "ns";
+    }
+    out << std::endl;
+  }
+}
+
+}  // namespace profile
@@ -0,0 +1,465 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * ps.h: Parameter server and its client for distributed training over TCP
+ *
+ * Author: Theory of Computer Games
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "utils.h"
+#include "weight.h"
+
+/**
+ * a change of a single weight, net[table][index] += value
+ */
+struct ps_delta {
+  uint32_t table;
+  uint32_t index;
+  weight::type value;
+};
+
+/**
+ * the messages between the actors and the server, each of which is
+ * (type:uint32) (size:uint64) (payload), little-endian
+ *
+ * push:    a batch of deltas, answered by nothing
+ * pull:    no payload, answered by a weights or an update message
+ * weights: every table, skipping the zero entries
+ * update:  the deltas pushed by the other actors since the last pull
+ * done:    no payload, sent by an actor that has finished
+ *
+ * both deltas and tables are sent sparsely, per table as
+ * (table:varint) (n:varint) (gap to the previous index:varint)... (value)...
+ * preceded by the number of tables (varint); a weights message also gives
+ * the size of each table (varint) right after its table number
+ */
+namespace ps {
+
+enum message : uint32_t { push = 1, pull = 2, weights = 3, update = 4, done = 5 };
+
+/**
+ * sort and merge the deltas of the same weight, dropping the zero ones
+ */
+inline void coalesce(std::vector<ps_delta>& deltas) {
+  std::sort(deltas.begin(), deltas.end(),
+            [](const ps_delta& a, const ps_delta& b) {
+              return a.table != b.table ? a.table < b.table : a.index < b.index;
+            });
+  size_t n = 0;
+  for (size_t i = 0; i < deltas.size(); i++) {
+    if (n && deltas[n - 1].table == deltas[i].table &&
+        deltas[n - 1].index == deltas[i].index) {
+      deltas[n - 1].value += deltas[i].value;
+    } else {
+      deltas[n++] = deltas[i];
+    }
+  }
+  deltas.resize(n);
+  deltas.erase(std::remove_if(deltas.begin(), deltas.end(),
+                              [](const ps_delta& d) { return d.value == 0; }),
+               deltas.end());
+}
+
+inline void put_values(std::string& buf, const weight::type* v, size_t n) {
+  buf.append(reinterpret_cast<const char*>(v), n * sizeof(weight::type));
+}
+
+/**
+ * encode coalesced deltas
+ */
+inline void encode(const std::vector<ps_delta>& deltas, std::string& buf) {
+  std::vector<weight::type> values;
+  size_t tables = 0;
+  for (size_t i = 0; i < deltas.size(); i++)
+    tables += (i == 0 || deltas[i].table != deltas[i - 1].table);
+  put_varint(buf, tables);
+  for (size_t i = 0, j; i < deltas.size(); i = j) {
+    for (j = i; j < deltas.size() && deltas[j].table == deltas[i].table;) j++;
+    put_varint(buf, deltas[i].table);
+    put_varint(buf, j - i);
+    values.clear();
+    for (size_t k = i, last = 0; k < j; last = deltas[k++].index) {
+      put_varint(buf, deltas[k].index - last);
+      values.push_back(deltas[k].value);
+    }
+    put_values(buf, values.data(), values.size());
+  }
+}
+
+/**
+ * encode the nonzero entries of every table
+ */
+inline void encode(const std::vector<weight>& net, std::string& buf) {
+  std::vector<weight::type> values;
+  put_varint(buf, net.size());
+  for (size_t t = 0; t < net.size(); t++) {
+    const weight& w = net[t];
+    size_t n = w.size() - std::count(w.data(), w.data() + w.size(), 0.0f);
+    put_varint(buf, t);
+    put_varint(buf, w.size());
+    put_varint(buf, n);
+    values.clear();
+    for (size_t i = 0, last = 0; i < w.size(); i++) {
+      if (w[i] == 0) continue;
+      put_varint(buf, i - last);
+      values.push_back(w[i]);
+      last = i;
+    }
+    put_values(buf, values.data(), values.size());
+  }
+}
+
+/**
+ * decode the sparse entries of [p, end), calling f(table, size, index, value)
+ * for each one, where size is the table size given by a weights message or 0
+ * return false if the payload is malformed
+ */
+template <typename function>
+bool decode(const char* p, const char* end, bool sized, function f) {
+  uint64_t tables = 0;
+  if (!get_varint(p, end, tables)) return false;
+  std::vector<uint64_t> index;
+  for (uint64_t t = 0; t < tables; t++) {
+    uint64_t table = 0, size = 0, n = 0;
+    if (!get_varint(p, end, table)) return false;
+    if (sized && !get_varint(p, end, size)) return false;
+    if (!get_varint(p, end, n) || n > uint64_t(end - p)) return false;
+    index.resize(n);
+    for (uint64_t i = 0, last = 0; i < n; i++) {
+      uint64_t gap = 0;
+      if (!get_varint(p, end, gap)) return false;
+      index[i] = last += gap;
+    }
+    if (uint64_t(end - p) < n * sizeof(weight::type)) return false;
+    for (uint64_t i = 0; i < n; i++, p += sizeof(weight::type)) {
+      weight::type v;
+      std::memcpy(&v, p, sizeof(v));
+      if (!f(table, size, index[i], v)) return false;
+    }
+    if (n == 0 && !f(table, size, uint64_t(-1), 0)) return false;
+  }
+  return p == end;
+}
+
+/**
+ * blocking transfers of whole messages over a connected socket
+ */
+inline bool send_all(int fd, const char* p, size_t n) {
+  while (n) {
+    ssize_t k = ::send(fd, p, n, MSG_NOSIGNAL);
+    if (k < 0 && errno == EINTR) continue;
+    if (k <= 0) return false;
+    p += k, n -= k;
+  }
+  return true;
+}
+inline bool recv_all(int fd, char* p, size_t n) {
+  while (n) {
+    ssize_t k = ::recv(fd, p, n, 0);
+    if (k < 0 && errno == EINTR) continue;
+    if (k <= 0) return false;
+    p += k, n -= k;
+  }
+  return true;
+}
+inline bool send(int fd, message type, const std::string& payload) {
+  char head[12];
+  uint32_t t = type;
+  uint64_t size = payload.size();
+  std::memcpy(head, &t, 4);
+  std::memcpy(head + 4, &size, 8);
+  return send_all(fd, head, sizeof(head)) &&
+         send_all(fd, payload.data(), payload.size());
+}
+inline bool recv(int fd, message& type, std::string& payload) {
+  char head[12];
+  if (!recv_all(fd, head, sizeof(head))) return false;
+  uint32_t t;
+  uint64_t size;
+  std::memcpy(&t, head, 4);
+  std::memcpy(&size, head + 4, 8);
+  type = message(t);
+  payload.resize(size);
+  return recv_all(fd, &payload[0], size);
+}
+
+}  // namespace ps
+
+/**
+ * connection of an actor to the parameter server, shared by the sliders of
+ * the same process
+ */
+class ps_client {
+ public:
+  /**
+   * connect to "host:port", or exit if the server is unreachable
+   */
+  ps_client(const std::string& address)
+      : fd(-1), address(address), pulled(0), pushed(0) {
+    std::string host = address.substr(0, address.rfind(':'));
+    std::string port = address.substr(address.rfind(':') + 1);
+    addrinfo hints = {}, *res = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (::getaddrinfo(host.c_str(), port.c_str(), &hints, &res) == 0) {
+      for (addrinfo* ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd >= 0 && ::connect(fd, ai->ai_addr, ai->ai_addrlen) != 0)
+          ::close(fd), fd = -1;
+      }
+      ::freeaddrinfo(res);
+    }
+    if (fd < 0) error("cannot connect");
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  ps_client(const ps_client&) = delete;
+  ~ps_client() {
+    if (fd >= 0) ps::send(fd, ps::done, "");
+    if (fd >= 0) ::close(fd);
+  }
+
+  /**
+   * send a batch of deltas, which is coalesced in place and then cleared
+   */
+  void push(std::vector<ps_delta>& deltas) {
+    ps::coalesce(deltas);
+    std::string buf;
+    ps::encode(deltas, buf);
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!ps::send(fd, ps::push, buf)) error("cannot push");
+    for (const ps_delta& d : deltas) {
+      if (d.table < base.size() && d.index < base[d.table].size())
+        base[d.table][d.index] += d.value;
+    }
+    pushed += deltas.size();
+    deltas.clear();
+  }
+
+  /**
+   * bring the tables up to date with the server, whose sizes should match
+   * the first pull takes the tables of the server, and keeps a copy of them
+   * as the base, i.e., the tables as the server has them, which follows the
+   * later pulls and pushes; a pull after falling far behind then adds the
+   * difference between the tables of the server and the base, so that the
+   * deltas of the sliders sharing the tables that are not yet pushed are
+   * kept, and the sliders never read a partly cleared table
+   * the other pulls add the deltas pushed by the other actors meanwhile
+   */
+  void pull(std::vector<weight>& net) {
+    std::lock_guard<std::mutex> lock(mtx);
+    ps::message type;
+    if (!ps::send(fd, ps::pull, "") || !ps::recv(fd, type, in) ||
+        (type != ps::weights && type != ps::update))
+      error("cannot pull");
+    const char* begin = in.data();
+    const char* end = in.data() + in.size();
+    bool ok;
+    if (type == ps::update) {
+      ok = ps::decode(begin, end, false,
+                      [&](uint64_t t, uint64_t, uint64_t i, float v) {
+                        if (i == uint64_t(-1)) return true;
+                        if (t >= net.size() || i >= net[t].size()) return false;
+                        net[t][i] += v;
+                        if (t < base.size() && i < base[t].size()) base[t][i] += v;
+                        return true;
+                      });
+    } else {
+      std::vector<std::vector<weight::type>> staged(net.size());
+      ok = ps::decode(begin, end, true,
+                      [&](uint64_t t, uint64_t size, uint64_t i, float v) {
+                        if (t >= net.size() || net[t].size() != size)
+                          return false;
+                        if (staged[t].size() != size) staged[t].assign(size, 0);
+                        if (i < size) staged[t][i] = v;
+                        return i < size || i == uint64_t(-1);
+                      });
+      base.resize(net.size());
+      for (size_t t = 0; ok && t < net.size(); t++) {
+        if (staged[t].empty()) continue;
+        weight::type* w = net[t].data();
+        if (base[t].size() == staged[t].size()) {
+          for (size_t i = 0; i < staged[t].size(); i++)
+            w[i] += staged[t][i] - base[t][i];
+        } else {
+          std::copy(staged[t].begin(), staged[t].end(), w);
+        }
+        base[t].swap(staged[t]);
+      }
+    }
+    if (!ok) error("mismatched tables");
+    pulled++;
+  }
+
+  size_t pulls() const { return pulled; }
+  size_t deltas() const { return pushed; }
+
+ private:
+  [[noreturn]] void error(const char* what) {
+    std::cerr << "parameter server " << address << ": " << what << std::endl;
+    std::exit(-1);
+  }
+
+  int fd;
+  std::string address;
+  std::mutex mtx;
+  std::string in;
+  std::vector<std::vector<weight::type>> base;  // the tables of the server
+  std::atomic<size_t> pulled;
+  size_t pushed;
+};
+
+/**
+ * parameter server holding the tables of the learner
+ * every actor connection is served by its own thread; the deltas are added
+ * to the tables and pulls are answered under a single lock
+ * every actor is sent the whole tables on its first pull, and then only the
+ * deltas pushed by the others since its last pull, unless they outgrow a
+ * quarter of the tables, e.g., for an actor that rarely pulls
+ * run() returns once the expected number of actors have finished, i.e., have
+ * sent 'done', however they come and go meanwhile
+ */
+class ps_server {
+ public:
+  ps_server(unsigned port, std::vector<weight>& net, size_t expected)
+      : net(net),
+        port(port),
+        fd(-1),
+        expected(std::max<size_t>(expected, 1)),
+        served(0),
+        finished(0),
+        pushes(0) {}
+  ~ps_server() {
+    if (fd >= 0) ::close(fd);
+  }
+
+  void run() {
+    fd = ::socket(AF_INET6, SOCK_STREAM, 0);
+    int one = 1, zero = 0;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    sockaddr_in6 addr = {};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+    if (fd < 0 || ::bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+        ::listen(fd, 64) != 0) {
+      std::cerr << "parameter server: cannot listen on " << port << std::endl;
+      std::exit(-1);
+    }
+    std::cerr << "parameter server: listening on " << port << std::endl;
+
+    std::vector<std::thread> threads;
+    while (true) {
+      int conn = ::accept(fd, nullptr, nullptr);
+      if (conn < 0 && errno == EINTR) continue;
+      if (conn < 0) break;
+      ::setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      served++;
+      threads.emplace_back(&ps_server::serve, this, conn);
+    }
+    for (std::thread& t : threads) t.join();
+    std::cerr << "parameter server: " << served << " actors, " << pushes
+              << " pushes" << std::endl;
+  }
+
+ private:
+  /**
+   * the deltas not yet pulled by an actor, if it has pulled the tables
+   */
+  struct peer {
+    std::vector<ps_delta> pending;
+    bool synced = false;
+  };
+
+  void serve(int conn) {
+    std::list<peer>::iterator self;
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      self = peers.emplace(peers.end());
+    }
+    size_t limit = 0;
+    for (const weight& w : net) limit += w.size() / 4;
+    std::string in, out;
+    std::vector<ps_delta> deltas;
+    bool done = false;
+    for (ps::message type; !done && ps::recv(conn, type, in);) {
+      std::unique_lock<std::mutex> lock(mtx);
+      if (type == ps::push) {
+        pushes++;
+        deltas.clear();
+        bool ok = ps::decode(in.data(), in.data() + in.size(), false,
+                             [&](uint64_t t, uint64_t, uint64_t i, float v) {
+                               if (i == uint64_t(-1)) return true;
+                               if (t >= net.size() || i >= net[t].size())
+                                 return false;
+                               net[t][i] += v;
+                               deltas.push_back({uint32_t(t), uint32_t(i), v});
+                               return true;
+                             });
+        if (!ok) break;
+        for (auto it = peers.begin(); it != peers.end(); ++it) {
+          if (it == self || !it->synced) continue;
+          it->pending.insert(it->pending.end(), deltas.begin(), deltas.end());
+          if (it->pending.size() > limit) {
+            it->synced = false;  // the whole tables are cheaper then
+            it->pending = std::vector<ps_delta>();
+          }
+        }
+      } else if (type == ps::pull) {
+        out.clear();
+        ps::message reply = self->synced ? ps::update : ps::weights;
+        if (self->synced) {
+          ps::coalesce(self->pending);
+          ps::encode(self->pending, out);
+        } else {
+          ps::encode(net, out);
+        }
+        self->pending.clear();
+        self->synced = true;
+        lock.unlock();
+        if (!ps::send(conn, reply, out)) break;
+      } else {
+        done = type == ps::done;
+        if (!done) break;
+      }
+    }
+    ::close(conn);
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      peers.erase(self);
+    }
+    // the server stops with the last actor, so that the tables can be saved
+    if (done && ++finished >= expected) ::shutdown(fd, SHUT_RDWR);
+  }
+
+  std::vector<weight>& net;
+  unsigned port;
+  int fd;
+  std::mutex mtx;
+  std::list<peer> peers;
+  size_t expected;  // the actors to finish before stopping
+  std::atomic<size_t> served;
+  std::atomic<size_t> finished;
+  size_t pushes;
+};
@@ -0,0 +1,85 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * quantize.cpp: Convert weight files to fp16, scaled int16 or sparse tables
+ *               for inference
+ *
+ * Author: Theory of Computer Games
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include "agent.h"
+
+/**
+ * expose the tables of a weight file
+ */
+class weight_file : public weight_agent {
+ public:
+  weight_file(const std::string& path) : weight_agent("load=" + path) {}
+  using weight_agent::table_count;
+  using weight_agent::table_size;
+  using weight_agent::table_value;
+  size_t bytes() const {
+    size_t n = 0;
+    for (size_t t = 0; t < table_count(); t++) n += table_bytes(t);
+    return n;
+  }
+};
+
+int main(int argc, const char* argv[]) {
+  std::string in_path, out_path, format = "fp16", touched;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    auto match_arg = [&](std::string flag) -> bool {
+      auto it = arg.find_first_not_of('-');
+      return arg.find(flag, it) == it;
+    };
+    auto next_opt = [&]() -> std::string {
+      auto it = arg.find('=') + 1;
+      return it ? arg.substr(it) : argv[++i];
+    };
+    if (match_arg("in")) {
+      in_path = next_opt();
+    } else if (match_arg("out")) {
+      out_path = next_opt();
+    } else if (match_arg("format")) {
+      format = next_opt();
+    } else if (match_arg("touched")) {
+      touched = next_opt();
+    }
+  }
+  if (in_path.empty() || out_path.empty()) {
+    std::cerr << "usage: " << argv[0]
+              << " --in=weights.bin --out=weights-fp16.bin --format=fp16|int16|float32|sparse"
+              << " [--touched=access.bin]" << std::endl;
+    return 1;
+  }
+
+  weight_file in(in_path);
+  in.notify("quantize=" + format);
+  if (touched.size()) in.notify("touched=" + touched);  // for sparse tables
+  if (!in.snapshot(out_path)) return 1;
+
+  // report the error of every table after the conversion
+  weight_file out(out_path);
+  std::cout << std::fixed << std::setprecision(6);
+  for (size_t t = 0; t < in.table_count(); t++) {
+    double max = 0, sum = 0;
+    for (size_t i = 0; i < in.table_size(t); i++) {
+      double e = std::fabs(double(in.table_value(t, i)) - out.table_value(t, i));
+      max = std::max(max, e);
+      sum += e;
+    }
+    std::cout << "table " << t << ": " << in.table_size(t) << " entries, max error = "
+              << max << ", avg error = " << (sum / std::max<size_t>(in.table_size(t), 1))
+              << std::endl;
+  }
+  std::cout << in_path << " (" << in.bytes() << " bytes) -> " << out_path << " ("
+            << out.bytes() << " bytes, " << format << ")" << std::endl;
+  return 0;
+}
@@ -0,0 +1,471 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * service.h: Daemon answering the moves of a frozen network over sockets
+ *
+ * Author: Theory of Computer Games
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "agent.h"
+#include "board.h"
+#include "ps.h"
+
+/**
+ * the messages between the game services and the move server, framed as
+ * those of ps.h, i.e., (type:uint32) (size:uint64) (payload), little-endian
+ *
+ * boards: n boards, each of which is its packed tiles (uint64), i.e., the
+ *         tile of cell k in bits [4k, 4k + 4) as board::raw()
+ * moves:  the answer to a boards message, n moves in the same order, each as
+ *         (op:int32) (value:float32), where op is the slide or -1 if there is
+ *         none, and value is the reward plus the value of the afterstate
+ *
+ * the requests of a connection may be pipelined, and are answered in order
+ */
+namespace service {
+
+enum message : uint32_t { boards = 1, moves = 2 };
+
+struct move {
+  int32_t op;
+  float value;
+};
+
+static constexpr size_t head_size = 12;
+static constexpr size_t max_boards = 1 << 20;  // per message
+
+inline void put_head(std::string& buf, message type, uint64_t size) {
+  uint32_t t = type;
+  buf.append(reinterpret_cast<const char*>(&t), 4);
+  buf.append(reinterpret_cast<const char*>(&size), 8);
+}
+inline void get_head(const char* p, message& type, uint64_t& size) {
+  uint32_t t;
+  std::memcpy(&t, p, 4);
+  std::memcpy(&size, p + 4, 8);
+  type = message(t);
+}
+
+/**
+ * an address is either "PORT" (to listen on every interface) or "HOST:PORT"
+ * over TCP, or the path of a Unix socket, e.g., "/tmp/threes.sock"
+ */
+inline bool is_local(const std::string& address) {
+  return address.find('/') != std::string::npos;
+}
+
+/**
+ * whether the port of a TCP address, i.e., what follows the last ':', if
+ * any, is a number in [1, 65535]
+ */
+inline bool valid_port(const std::string& address) {
+  std::string port = address.substr(address.rfind(':') + 1);
+  if (port.empty() || port.size() > 5 ||
+      port.find_first_not_of("0123456789") != std::string::npos)
+    return false;
+  return std::stoul(port) >= 1 && std::stoul(port) <= 65535;
+}
+
+/**
+ * a non-blocking socket listening on the address, or -1 on failure
+ */
+inline int listen_on(const std::string& address) {
+  if (!is_local(address) && !valid_port(address)) return -1;
+  int fd = -1;
+  if (is_local(address)) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (address.size() >= sizeof(addr.sun_path)) return -1;
+    std::strcpy(addr.sun_path, address.c_str());
+    ::unlink(address.c_str());  // left by a previous daemon
+    fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && ::bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0)
+      ::close(fd), fd = -1;
+  } else if (address.find(':') != std::string::npos) {
+    std::string host = address.substr(0, address.rfind(':'));
+    std::string port = address.substr(address.rfind(':') + 1);
+    addrinfo hints = {}, *res = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (::getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0) return -1;
+    int one = 1;
+    for (addrinfo* ai = res; ai && fd < 0; ai = ai->ai_next) {
+      fd = ::socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+      if (fd >= 0) ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      if (fd >= 0 && ::bind(fd, ai->ai_addr, ai->ai_addrlen) != 0)
+        ::close(fd), fd = -1;
+    }
+    ::freeaddrinfo(res);
+  } else {
+    fd = ::socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1, zero = 0;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    sockaddr_in6 addr = {};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(std::stoi(address));
+    if (fd >= 0 && ::bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0)
+      ::close(fd), fd = -1;
+  }
+  if (fd >= 0 && ::listen(fd, 256) != 0) ::close(fd), fd = -1;
+  return fd;
+}
+
+/**
+ * a blocking socket connected to the address, or -1 on failure
+ */
+inline int connect_to(const std::string& address) {
+  int fd = -1;
+  if (is_local(address)) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (address.size() >= sizeof(addr.sun_path)) return -1;
+    std::strcpy(addr.sun_path, address.c_str());
+    fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && ::connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0)
+      ::close(fd), fd = -1;
+    return fd;
+  }
+  std::string host = address.substr(0, address.rfind(':'));
+  std::string port = address.substr(address.rfind(':') + 1);
+  addrinfo hints = {}, *res = nullptr;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (::getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0) return -1;
+  for (addrinfo* ai = res; ai && fd < 0; ai = ai->ai_next) {
+    fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd >= 0 && ::connect(fd, ai->ai_addr, ai->ai_addrlen) != 0)
+      ::close(fd), fd = -1;
+  }
+  ::freeaddrinfo(res);
+  int one = 1;
+  if (fd >= 0) ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+/**
+ * send all the bytes over a non-blocking socket, waiting while it is full
+ */
+inline bool send_all(int fd, const char* p, size_t n) {
+  while (n) {
+    ssize_t k = ::send(fd, p, n, MSG_NOSIGNAL);
+    if (k > 0) {
+      p += k, n -= k;
+    } else if (k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      pollfd out = {fd, POLLOUT, 0};
+      ::poll(&out, 1, -1);
+    } else if (k == 0 || errno != EINTR) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace service
+
+/**
+ * daemon answering the best moves of boards by a frozen n-tuple network,
+ * whose tables are loaded once and shared by the workers
+ *
+ * every worker has its own copy of the slider, and waits on an epoll instance
+ * shared by all of them, where every connection is armed one-shot, so that it
+ * is served by one worker at a time; the worker reads all the requests that
+ * have arrived, evaluates their boards by ntuple_slider::take_actions, and
+ * sends all the answers at once
+ * run() returns after stop() is called, e.g., by another thread
+ */
+class move_server {
+ public:
+  move_server(const std::string& address, const ntuple_slider& slide,
+              size_t threads)
+      : address(address),
+        slides(std::max<size_t>(threads, 1), slide),
+        ep(-1),
+        listener{-1, {}},
+        waker{-1, {}},
+        stopping(false),
+        served(0),
+        evaluated(0) {}
+  move_server(const move_server&) = delete;
+  ~move_server() {
+    for (connection* c : open) {
+      ::close(c->fd);
+      delete c;
+    }
+    if (listener.fd >= 0) ::close(listener.fd);
+    if (waker.fd >= 0) ::close(waker.fd);
+    if (ep >= 0) ::close(ep);
+    if (service::is_local(address)) ::unlink(address.c_str());
+  }
+
+  /**
+   * listen on the address and serve until stop(), or exit if it is in use
+   */
+  void run() {
+    listener.fd = service::listen_on(address);
+    waker.fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ep = ::epoll_create1(EPOLL_CLOEXEC);
+    if (listener.fd < 0 || waker.fd < 0 || ep < 0) {
+      std::cerr << "move server: cannot listen on " << address
+                << " (PORT, HOST:PORT, or the path of a Unix socket)" << std::endl;
+      std::exit(-1);
+    }
+    arm(listener, EPOLL_CTL_ADD);
+    epoll_event ev = {};
+    ev.events = EPOLLIN;  // level-triggered, so that every worker wakes up
+    ev.data.ptr = &waker;
+    ::epoll_ctl(ep, EPOLL_CTL_ADD, waker.fd, &ev);
+    std::cerr << "move server: listening on " << address << " with "
+              << slides.size() << " threads" << std::endl;
+
+    std::vector<std::thread> threads;
+    for (ntuple_slider& slide : slides)
+      threads.emplace_back(&move_server::work, this, std::ref(slide));
+    for (std::thread& t : threads) t.join();
+    std::cerr << "move server: " << served << " requests, " << evaluated
+              << " boards" << std::endl;
+  }
+
+  void stop() {
+    if (!wake()) std::cerr << "move server: cannot stop" << std::endl;
+  }
+
+  /**
+   * stop on SIGINT and SIGTERM, e.g., to remove the Unix socket on exit,
+   * where the handler only does what is async-signal-safe, see wake()
+   */
+  void stop_on_signals() {
+    static move_server* self = nullptr;
+    self = this;
+    auto handler = [](int) { self->wake(); };
+    std::signal(SIGINT, handler);
+    std::signal(SIGTERM, handler);
+  }
+
+  size_t requests() const { return served; }
+  size_t boards() const { return evaluated; }
+
+ private:
+  /**
+   * a client, or the listening socket, with the bytes of a partial request
+   */
+  struct connection {
+    int fd;
+    std::string in;
+  };
+
+  /**
+   * make the workers return, which is async-signal-safe: a lock-free store
+   * and a write to the eventfd
+   */
+  bool wake() {
+    stopping = true;
+    uint64_t one = 1;
+    return waker.fd < 0 || ::write(waker.fd, &one, sizeof(one)) >= 0;
+  }
+
+  void arm(connection& c, int op) {
+    epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = &c;
+    ::epoll_ctl(ep, op, c.fd, &ev);
+  }
+
+  void work(ntuple_slider& slide) {
+    std::vector<char> chunk(1 << 16);
+    std::vector<board::bits> before;
+    std::vector<int> op;
+    std::vector<float> value;
+    std::string out;
+    while (!stopping) {
+      epoll_event ev;
+      int n = ::epoll_wait(ep, &ev, 1, -1);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0 || ev.data.ptr == &waker) break;
+
+      if (ev.data.ptr == &listener) {
+        accept();
+        arm(listener, EPOLL_CTL_MOD);
+        continue;
+      }
+
+      // the requests that have arrived are answered even if the client has
+      // closed its side since, e.g., right after its last request
+      connection& c = *static_cast<connection*>(ev.data.ptr);
+      bool connected = receive(c, chunk);
+      bool alive = true;
+      size_t p = 0;
+      out.clear();
+      while (alive && c.in.size() - p >= service::head_size) {
+        service::message type;
+        uint64_t size;
+        service::get_head(&c.in[p], type, size);
+        if (type != service::boards || size % sizeof(board::bits) ||
+            size / sizeof(board::bits) > service::max_boards) {
+          alive = false;  // not a client of this protocol
+          break;
+        }
+        if (c.in.size() - p - service::head_size < size) break;
+
+        size_t k = size / sizeof(board::bits);
+        before.resize(k), op.resize(k), value.resize(k);
+        std::memcpy(before.data(), &c.in[p + service::head_size], size);
+        slide.take_actions(before.data(), k, op.data(), value.data());
+        service::put_head(out, service::moves, k * sizeof(service::move));
+        size_t at = out.size();
+        out.resize(at + k * sizeof(service::move));
+        for (size_t i = 0; i < k; i++) {
+          service::move m = {op[i], value[i]};
+          std::memcpy(&out[at + i * sizeof(m)], &m, sizeof(m));
+        }
+        p += service::head_size + size;
+        served++;
+        evaluated += k;
+      }
+      c.in.erase(0, p);
+      if (alive && out.size())
+        alive = service::send_all(c.fd, out.data(), out.size());
+      if (alive && connected) {
+        arm(c, EPOLL_CTL_MOD);
+      } else {
+        close(c);
+      }
+    }
+  }
+
+  /**
+   * append the bytes that have arrived, return false if the client is gone,
+   * i.e., it has closed its side or the connection is broken
+   */
+  static bool receive(connection& c, std::vector<char>& chunk) {
+    while (true) {
+      ssize_t k = ::recv(c.fd, chunk.data(), chunk.size(), 0);
+      if (k > 0) c.in.append(chunk.data(), k);
+      if (k > 0 && size_t(k) < chunk.size()) return true;
+      if (k > 0 || (k < 0 && errno == EINTR)) continue;
+      return k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+  }
+
+  void accept() {
+    int one = 1;
+    for (int fd; (fd = ::accept4(listener.fd, nullptr, nullptr,
+                                 SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0;) {
+      if (!service::is_local(address))
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      connection* c = new connection{fd, {}};
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        open.insert(c);
+      }
+      arm(*c, EPOLL_CTL_ADD);
+    }
+  }
+
+  void close(connection& c) {
+    ::close(c.fd);  // which also removes it from the epoll instance
+    std::lock_guard<std::mutex> lock(mtx);
+    open.erase(&c);
+    delete &c;
+  }
+
+  std::string address;
+  std::vector<ntuple_slider> slides;
+  int ep;
+  connection listener;
+  connection waker;
+  std::mutex mtx;
+  std::unordered_set<connection*> open;
+  std::atomic<bool> stopping;
+  std::atomic<size_t> served;
+  std::atomic<size_t> evaluated;
+};
+
+/**
+ * connection of a game service to the move server, where a request may be
+ * sent before the answers of the previous ones are received
+ */
+class move_client {
+ public:
+  /**
+   * connect to the address, or exit if the server is unreachable
+   */
+  move_client(const std::string& address)
+      : fd(service::connect_to(address)), address(address) {
+    if (fd < 0) error("cannot connect");
+  }
+  move_client(const move_client&) = delete;
+  ~move_client() {
+    if (fd >= 0) ::close(fd);
+  }
+
+  /**
+   * the moves of n boards, i.e., request() and then response()
+   */
+  void query(const board::bits* before, size_t n, service::move* moves) {
+    request(before, n);
+    response(moves, n);
+  }
+
+  /**
+   * send the boards of a request
+   */
+  void request(const board::bits* before, size_t n) {
+    out.clear();
+    service::put_head(out, service::boards, n * sizeof(board::bits));
+    out.append(reinterpret_cast<const char*>(before), n * sizeof(board::bits));
+    if (!ps::send_all(fd, out.data(), out.size())) error("cannot send");
+  }
+
+  /**
+   * receive the answer to the oldest request, which has n boards
+   */
+  void response(service::move* moves, size_t n) {
+    char head[service::head_size];
+    service::message type;
+    uint64_t size;
+    if (!ps::recv_all(fd, head, sizeof(head))) error("cannot receive");
+    service::get_head(head, type, size);
+    if (type != service::moves || size != n * sizeof(service::move))
+      error("mismatched answer");
+    if (!ps::recv_all(fd, reinterpret_cast<char*>(moves), size))
+      error("cannot receive");
+  }
+
+ private:
+  [[noreturn]] void error(const char* what) {
+    std::cerr << "move server " << address << ": " << what << std::endl;
+    std::exit(-1);
+  }
+
+  int fd;
+  std::string address;
+  std::string out;
+};
@@ -9,13 +9,115 @@
 
 #pragma once
 #include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <cstdio>
 #include <deque>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <numeric>
 #include <sstream>
+#include <stdexcept>
+#include <thread>
 
+#include "access.h"
 #include "action.h"
+#include "archive.h"
 #include "board.h"
+#include "cache.h"
 #include "episode.h"
+#include "profile.h"
+
+/**
+ * buffered writer which appends episodes to a file on a background thread,
+ * either as text lines or as a binary archive
+ * at most 'capacity' episodes are queued: push() waits while the queue is
+ * full, so the memory stays flat even if the disk falls behind the games
+ * the queued episodes are all written before the writer is destroyed, or
+ * waited for by idle()
+ */
+class episode_writer {
+ public:
+  episode_writer(const std::string& path, bool binary = false,
+                 size_t capacity = 4096)
+      : capacity(std::max<size_t>(capacity, 1)),
+        busy(false),
+        done(false),
+        worker() {
+    if (binary) bin.reset(new archive_writer(path));
+    if (!binary) out.open(path, std::ios::out | std::ios::trunc);
+    worker = std::thread(&episode_writer::run, this);
+  }
+  ~episode_writer() {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      done = true;
+    }
+    cv.notify_one();
+    worker.join();
+  }
+
+  void push(const episode& ep) {
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      space.wait(lock, [this] { return queue.size() < capacity; });
+      queue.push_back(ep);
+    }
+    cv.notify_one();
+  }
+
+  /**
+   * wait until the queued episodes are written, after which the worker holds
+   * no lock until the next push(), e.g., before the process is forked
+   */
+  void idle() {
+    std::unique_lock<std::mutex> lock(mtx);
+    space.wait(lock, [this] { return queue.empty() && !busy; });
+  }
+
+ private:
+  void run() {
+    std::vector<episode> batch;  // swapped with the queue, keeping the space
+    for (bool stop = false; !stop;) {
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [this] { return done || queue.size(); });
+        batch.swap(queue);
+        busy = true;
+        stop = done;
+      }
+      space.notify_all();
+      for (const episode& ep : batch) write(ep);
+      batch.clear();
+      if (bin) bin->flush();
+      if (!bin) out.flush();
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        busy = false;
+      }
+      space.notify_all();
+    }
+  }
+  void write(const episode& ep) {
+    if (bin) return bin->write(ep);
+    out << ep << '\n';
+  }
+
+  std::ofstream out;
+  std::unique_ptr<archive_writer> bin;
+  std::vector<episode> queue;
+  size_t capacity;
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::condition_variable space;  // when the queue is taken or written
+  bool busy;  // while a batch is written
+  bool done;
+  std::thread worker;
+};
 
 class statistics {
  public:
@@ -34,7 +136,8 @@ class statistics {
 
  public:
   /**
-   * show the statistics of last 'block' games
+   * show the statistics of the episodes recorded since the last report, i.e.,
+   * the last 'block' games
    *
    * the format is
    * 1000    avg = 282, max = 2325, ops = 1346086 (2840867|955796)
@@ -53,94 +156,368 @@ class statistics {
    * 955796 '84.1%': 84.1% of the games reached 24-tiles, i.e., win rate of
    * 24-tile '45.3%': 45.3% of the games terminated with 24-tiles as the largest
    * tile
+   *
+   * the report prints the running totals of the block, so it costs the same
+   * however large the block is
    */
-  void show(bool tstat = true, size_t blk = 0) const {
-    size_t num = std::min(data.size(), blk ?: block);
-    size_t stat[64] = {0};
-    size_t sop = 0, pop = 0, eop = 0;
-    time_t sdu = 0, pdu = 0, edu = 0;
-    board::score sum = 0, max = 0;
-    auto it = data.end();
-    for (size_t i = 0; i < num; i++) {
-      auto& ep = *(--it);
-      sum += ep.score();
-      max = std::max(ep.score(), max);
-      stat[*std::max_element(ep.state().begin(), ep.state().end())]++;
-      sop += ep.step();
-      pop += ep.step(action::slide::type);
-      eop += ep.step(action::place::type);
-      sdu += ep.time();
-      pdu += ep.time(action::slide::type);
-      edu += ep.time(action::place::type);
-    }
-
-    std::ios ff(nullptr);
-    ff.copyfmt(std::cout);
-    std::cout << std::fixed << std::setprecision(0);
-    std::cout << count << "\t";
-    std::cout << "avg = " << (sum / num) << ", ";
-    std::cout << "max = " << (max) << ", ";
-    std::cout << "ops = " << (sop * 1000.0 / sdu);
-    std::cout << " (" << (pop * 1000.0 / pdu);
-    std::cout << "|" << (eop * 1000.0 / edu) << ")";
-    std::cout << std::endl;
-    std::cout.copyfmt(ff);
-
-    if (!tstat) return;
-    for (size_t t = 0, c = 0; c < num; c += stat[t++]) {
-      if (stat[t] == 0) continue;
-      size_t accu =
-          std::accumulate(std::begin(stat) + t, std::end(stat), size_t(0));
-      std::cout << "\t" << board::itot(t);               // type
-      std::cout << "\t" << (accu * 100.0 / num) << "%";  // win rate
-      std::cout << "\t"
-                   "("
-                << (stat[t] * 100.0 / num)
-                << "%"
-                   ")";  // percentage of ending
-      std::cout << std::endl;
-    }
-    std::cout << std::endl;
+  void show(bool tstat = true) {
+    print(current, tstat);
+    current = totals();
   }
 
-  void summary() const { show(true, data.size()); }
+  /**
+   * show the statistics of all the kept episodes, e.g., those just loaded
+   */
+  void summary() const {
+    totals t;
+    for (const episode& ep : data) t.add(ep);
+    print(t, true);
+  }
 
   bool is_finished() const { return count >= total; }
 
   void open_episode(const std::string& flag = "") {
-    if (count++ >= limit) data.pop_front();
-    data.emplace_back();
+    next() = episode();
     data.back().open_episode(flag);
   }
 
   void close_episode(const std::string& flag = "") {
     data.back().close_episode(flag);
+    add(tally(data.back()));
+    archive(data.back());
     if (count % block == 0) show();
   }
 
-  episode& at(size_t i) { return data.at(i); }
+  /**
+   * the totals of some episodes, where each is added in O(1) by merge()
+   */
+  struct totals;
+
+  /**
+   * the totals of a closed episode, which take a pass over its moves, so
+   * that the workers can tally their episodes at the same time, and leave
+   * only the merge to append_episode()
+   */
+  static totals tally(const episode& ep);
+
+  /**
+   * append an episode which has been played elsewhere, e.g., by a worker
+   * thread, with its tally if given; the episode should be already closed
+   * the episodes are appended by a single thread at a time, in the order of
+   * their indices, so that every block reports exactly its own episodes
+   */
+  void append_episode(episode&& ep) {
+    totals t = tally(ep);
+    append_episode(std::move(ep), t);
+  }
+  void append_episode(episode&& ep, const totals& t) {
+    next() = std::move(ep);  // 'ep' takes the buffer of the dropped one
+    add(t);
+    archive(data.back());
+    if (count % block == 0) show();
+  }
+  /**
+   * write every closed episode to a file in the background, rather than
+   * keeping all of them for operator<<
+   * only the episodes of the last block are kept in the memory afterward
+   */
+  void stream(const std::string& path, bool binary = false) {
+    writer.reset(new episode_writer(path, binary));
+    for (const episode& ep : data) writer->push(ep);
+    limit = block;
+    while (data.size() > limit) data.pop_front();
+  }
+  bool streaming() const { return writer != nullptr; }
+
+  /**
+   * wait until the streamed episodes are written, see episode_writer::idle()
+   */
+  void idle() {
+    if (writer) writer->idle();
+  }
+
+  episode& at(size_t i) {
+    if (i >= data.size()) throw std::out_of_range("statistics::at");
+    return *std::next(data.begin(), i);
+  }
   episode& front() { return data.front(); }
   episode& back() { return data.back(); }
   size_t step() const { return count; }
 
+  /**
+   * start from episode 'first' rather than 0, e.g., the first one of a shard,
+   * as if the episodes before it had been played elsewhere
+   */
+  void skip(size_t first) {
+    count = std::max(count, first);
+    total = std::max(total, count);
+  }
+
+  /**
+   * the compact progress of a run, i.e., its range of episodes [first, last),
+   * the next episode to play, and the totals of the episodes played so far,
+   * which is all that is needed to resume the run, or to merge the summaries
+   * of the shards of a run, without replaying any episode
+   *
+   * the layout of a progress file (little-endian) is the header followed by
+   * the totals as uint64_t: episodes, score, max, ops[3], time[3], tiles[16]
+   */
+  struct progress_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t fields;  // the number of the totals
+    uint64_t first;
+    uint64_t last;
+    uint64_t count;
+  };
+  static constexpr char progress_magic[8] = {'t', 'h', 'r', 'e', 'e', 's', 'p', 'g'};
+  static constexpr uint32_t progress_version = 1;
+  static constexpr size_t progress_fields = 25;
+
+  /**
+   * save the progress of the range [first, total) atomically, i.e., to a
+   * temporary file then rename it, so that a run killed at any time leaves
+   * the last complete progress
+   */
+  bool save_progress(const std::string& path, size_t first) const {
+    std::array<uint64_t, progress_fields> v = overall.fields();
+    progress_header h = {{}, progress_version, uint32_t(v.size()), first, total, count};
+    std::copy(progress_magic, progress_magic + 8, h.magic);
+    std::string temp = path + ".tmp";
+    std::ofstream out(temp, std::ios::out | std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    out.write(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(uint64_t));
+    out.close();
+    return out && std::rename(temp.c_str(), path.c_str()) == 0;
+  }
+  /**
+   * read a progress file, return false if there is none or it is invalid
+   */
+  static bool read_progress(const std::string& path, progress_header& h,
+                            std::array<uint64_t, progress_fields>& v) {
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    if (!in.is_open()) return false;
+    in.read(reinterpret_cast<char*>(&h), sizeof(h));
+    if (!in || !std::equal(h.magic, h.magic + 8, progress_magic) ||
+        h.version != progress_version || h.fields != v.size())
+      return false;
+    in.read(reinterpret_cast<char*>(v.data()), v.size() * sizeof(uint64_t));
+    return bool(in);
+  }
+  /**
+   * resume the range [first, total) from its progress file, return false if
+   * there is none yet; the run should be the same one, i.e., the same range
+   */
+  bool load_progress(const std::string& path, size_t first) {
+    progress_header h;
+    std::array<uint64_t, progress_fields> v;
+    if (!read_progress(path, h, v)) return false;
+    if (h.first != first || h.last != total)
+      throw std::invalid_argument("mismatched progress " + path);
+    overall = totals::from(v);
+    count = h.count;
+    return true;
+  }
+  /**
+   * add the totals of a progress file, e.g., of a shard, to those of this run
+   * and return its header; the ranges are not checked here
+   */
+  progress_header merge_progress(const std::string& path) {
+    progress_header h;
+    std::array<uint64_t, progress_fields> v;
+    if (!read_progress(path, h, v))
+      throw std::invalid_argument("invalid progress " + path);
+    overall.merge(totals::from(v));
+    count += h.count - h.first;
+    total = std::max(total, count);
+    return h;
+  }
+
+  /**
+   * show the statistics of all the episodes played by the run, including
+   * those before it was resumed, or of the shards merged by merge_progress()
+   */
+  void overview() const { print(overall, true); }
+
+  /**
+   * the episodes are written one per line, preceded by "#count=N" if some of
+   * the N played episodes have been dropped by 'limit'
+   */
   friend std::ostream& operator<<(std::ostream& out, const statistics& stat) {
+    if (stat.count > stat.data.size())
+      out << "#count=" << stat.count << std::endl;
     for (const episode& rec : stat.data) out << rec << std::endl;
     return out;
   }
   friend std::istream& operator>>(std::istream& in, statistics& stat) {
+    size_t count = 0;
     for (std::string line; std::getline(in, line) && line.size();) {
+      if (line.compare(0, 7, "#count=") == 0) {
+        count = std::stoull(line.substr(7));
+        continue;
+      }
       stat.data.emplace_back();
       std::stringstream(line) >> stat.data.back();
     }
-    stat.total = std::max(stat.total, stat.data.size());
-    stat.count = stat.data.size();
+    stat.count = std::max(count, stat.data.size());
+    stat.total = std::max(stat.total, stat.count);
     return in;
   }
 
+  void save(archive_writer& out) const {
+    for (const episode& rec : data) out.write(rec);
+  }
+  /**
+   * restore the counters from an archive
+   * when more episodes are going to be played, only the last 'limit' episodes
+   * are read, since the others will never be shown
+   */
+  void load(archive_reader& in) {
+    size_t keep = total > in.size() ? limit : in.size();
+    data.clear();
+    in.seek(in.size() - std::min(in.size(), keep));
+    for (episode rec; in.read(rec);) data.push_back(std::move(rec));
+    total = std::max(total, in.size());
+    count = in.size();
+  }
+
+ private:
+  /**
+   * the episode at the back for the next record, which reuses the oldest one
+   * if 'limit' episodes are kept, so that no memory is allocated to drop the
+   * oldest one and keep the next one
+   */
+  episode& next() {
+    if (count++ < limit || data.empty()) {
+      data.emplace_back();
+    } else {
+      data.splice(data.end(), data, data.begin());
+    }
+    return data.back();
+  }
+
+  void archive(const episode& ep) {
+    if (writer) writer->push(ep);
+  }
+  void add(const totals& t) {
+    current.merge(t);
+    overall.merge(t);
+  }
+
+ public:
+  struct totals {
+    size_t episodes = 0;
+    board::score score = 0;
+    board::score max = 0;
+    size_t ops[3] = {};   // of all, the slider, and the placer
+    time_t time[3] = {};  // in ms, as above
+    size_t tiles[16] = {};  // the episodes ending with tile i as the largest
+
+    void add(const episode& ep) {
+      board::bits raw = ep.state().raw();
+      board::cell tile = 0;
+      for (unsigned i = 0; i < 16; i++, raw >>= 4)
+        tile = std::max(tile, board::cell(raw & 0x0f));
+      episodes++;
+      score += ep.score();
+      max = std::max(max, ep.score());
+      tiles[tile]++;
+      const unsigned who[3] = {-1u, action::slide::type, action::place::type};
+      for (unsigned k = 0; k < 3; k++) {
+        ops[k] += ep.step(who[k]);
+        time[k] += ep.time(who[k]);
+      }
+    }
+    void merge(const totals& t) {
+      episodes += t.episodes;
+      score += t.score;
+      max = std::max(max, t.max);
+      for (unsigned k = 0; k < 3; k++) ops[k] += t.ops[k];
+      for (unsigned k = 0; k < 3; k++) time[k] += t.time[k];
+      for (unsigned i = 0; i < 16; i++) tiles[i] += t.tiles[i];
+    }
+
+    /**
+     * the totals as the fields of a progress file, and back
+     */
+    std::array<uint64_t, progress_fields> fields() const {
+      std::array<uint64_t, progress_fields> v = {};
+      v[0] = episodes;
+      v[1] = score;
+      v[2] = max;
+      std::copy(ops, ops + 3, v.begin() + 3);
+      std::copy(time, time + 3, v.begin() + 6);
+      std::copy(tiles, tiles + 16, v.begin() + 9);
+      return v;
+    }
+    static totals from(const std::array<uint64_t, progress_fields>& v) {
+      totals t;
+      t.episodes = v[0];
+      t.score = v[1];
+      t.max = v[2];
+      std::copy(v.begin() + 3, v.begin() + 6, t.ops);
+      std::copy(v.begin() + 6, v.begin() + 9, t.time);
+      std::copy(v.begin() + 9, v.end(), t.tiles);
+      return t;
+    }
+  };
+
+ private:
+  void print(const totals& t, bool tstat) const {
+    if (t.episodes == 0) return;
+    size_t num = t.episodes;
+    std::ios ff(nullptr);
+    ff.copyfmt(std::cout);
+    std::cout << std::fixed << std::setprecision(0);
+    std::cout << count << "\t";
+    std::cout << "avg = " << (t.score / num) << ", ";
+    std::cout << "max = " << (t.max) << ", ";
+    // the time is in ms, where less than 1 ms counts as 1 ms rather than
+    // making the speed infinite, e.g., for the placer of a short block
+    auto rate = [](size_t ops, time_t ms) {
+      return ops * 1000.0 / std::max<time_t>(ms, 1);
+    };
+    std::cout << "ops = " << rate(t.ops[0], t.time[0]);
+    std::cout << " (" << rate(t.ops[1], t.time[1]);
+    std::cout << "|" << rate(t.ops[2], t.time[2]) << ")";
+    std::cout << std::endl;
+    std::cout.copyfmt(ff);
+#ifdef THREES_PROFILE
+    profile::report(std::cout);
+#endif
+    value_cache::report(std::cout);
+    access_profile::report(std::cout);
+
+    if (!tstat) return;
+    for (size_t i = 0, c = 0; c < num; c += t.tiles[i++]) {
+      if (t.tiles[i] == 0) continue;
+      size_t accu =
+          std::accumulate(std::begin(t.tiles) + i, std::end(t.tiles), size_t(0));
+      std::cout << "\t" << board::itot(i);               // type
+      std::cout << "\t" << (accu * 100.0 / num) << "%";  // win rate
+      std::cout << "\t"
+                   "("
+                << (t.tiles[i] * 100.0 / num)
+                << "%"
+                   ")";  // percentage of ending
+      std::cout << std::endl;
+    }
+    std::cout << std::endl;
+  }
+
  private:
   size_t total;
   size_t block;
   size_t limit;
   size_t count;
-  std::deque<episode> data;
+  std::list<episode> data;  // whose nodes are reused by next()
+  std::unique_ptr<episode_writer> writer;
+  totals current;  // of the episodes of the block, see show()
+  totals overall;  // of all the episodes, added in order, see save_progress
 };
+
+inline statistics::totals statistics::tally(const episode& ep) {
+  totals t;
+  t.add(ep);
+  return t;
+}
@@ -7,15 +7,26 @@
  *         https://cgilab.nctu.edu.tw/
  */
 
+#include <omp.h>
+
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <iterator>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
 #include "action.h"
 #include "agent.h"
+#include "archive.h"
+#include "batch.h"
 #include "board.h"
+#include "checkpoint.h"
 #include "episode.h"
+#include "profile.h"
+#include "service.h"
 #include "statistics.h"
 
 int main(int argc, const char* argv[]) {
@@ -27,9 +38,13 @@ int main(int argc, const char* argv[]) {
             std::ostream_iterator<const char*>(std::cout, " "));
   std::cout << std::endl << std::endl;
 
-  size_t total = 1000, block = 0, limit = 0;
+  size_t total = 1000, block = 0, limit = 0, thread = 1, batch = 0;
   std::string slide_args, place_args;
-  std::string load_path, save_path;
+  std::string load_path, save_path, checkpoint_path, daemon;
+  std::string progress_path, merge_paths;
+  size_t every = 0, shard = 0, shards = 1;
+  unsigned interval = 0, serve = 0, actors = 0;
+  bool stream = false, binary = false, eval = false, search = false;
   for (int i = 1; i < argc; i++) {
     std::string arg = argv[i];
     auto match_arg = [&](std::string flag) -> bool {
@@ -46,6 +61,8 @@ int main(int argc, const char* argv[]) {
       block = std::stoull(next_opt());
     } else if (match_arg("limit")) {
       limit = std::stoull(next_opt());
+    } else if (match_arg("thread")) {
+      thread = std::max(std::stoull(next_opt()), 1ull);
     } else if (match_arg("slide") || match_arg("play")) {
       slide_args = next_opt();
     } else if (match_arg("place") || match_arg("env")) {
@@ -54,51 +71,296 @@ int main(int argc, const char* argv[]) {
       load_path = next_opt();
     } else if (match_arg("save")) {
       save_path = next_opt();
+    } else if (match_arg("stream")) {
+      stream = true;
+    } else if (match_arg("binary")) {
+      binary = true;
+    } else if (match_arg("checkpoint")) {
+      checkpoint_path = next_opt();
+    } else if (match_arg("every")) {
+      every = std::stoull(next_opt());
+    } else if (match_arg("interval")) {
+      interval = std::stoul(next_opt());
+    } else if (match_arg("serve")) {
+      std::string opt = next_opt();  // PORT/N for N actors
+      serve = std::stoul(opt);
+      if (opt.find('/') != std::string::npos)
+        actors = std::stoul(opt.substr(opt.find('/') + 1));
+    } else if (match_arg("daemon")) {
+      daemon = next_opt();
+    } else if (match_arg("batch")) {
+      batch = std::stoull(next_opt());
+    } else if (match_arg("eval")) {
+      eval = true;
+    } else if (match_arg("search")) {
+      search = true;
+    } else if (match_arg("shard")) {
+      std::string opt = next_opt();  // K/N, the K-th of N shards from 0
+      shard = std::stoull(opt);
+      shards = std::max(std::stoull(opt.substr(opt.find('/') + 1)), 1ull);
+    } else if (match_arg("progress")) {
+      progress_path = next_opt();
+    } else if (match_arg("merge")) {
+      merge_paths = next_opt();
+    }
+  }
+
+  // merge the progress files of the shards of a run, e.g.,
+  // --merge=run.0.progress,run.1.progress, and show the summary of all
+  if (merge_paths.size()) {
+    statistics all(0);
+    std::vector<std::pair<size_t, size_t>> played;
+    std::stringstream paths(merge_paths);
+    for (std::string path; std::getline(paths, path, ',');) {
+      statistics::progress_header h;
+      try {
+        h = all.merge_progress(path);
+      } catch (std::invalid_argument& e) {
+        std::cerr << e.what() << std::endl;
+        return -1;
+      }
+      played.emplace_back(h.first, h.count);
+      if (h.count < h.last)
+        std::cerr << path << ": unfinished, " << h.count - h.first << " of "
+                  << h.last - h.first << " episodes" << std::endl;
+    }
+    std::sort(played.begin(), played.end());
+    for (size_t i = 1; i < played.size(); i++) {
+      if (played[i].first < played[i - 1].second)
+        std::cerr << "shards overlap at episode " << played[i].first << std::endl;
     }
+    all.overview();
+    return 0;
   }
 
+  // play only the K-th of N equal ranges of the episodes, which are the same
+  // games whichever process plays them, as the environment is seeded by the
+  // index of each episode
+  if (shard >= shards) {
+    std::cerr << "invalid shard " << shard << "/" << shards << std::endl;
+    return -1;
+  }
+  size_t first = total * shard / shards;
+  total = total * (shard + 1) / shards;
+
   statistics stats(total, block, limit);
+  stats.skip(first);
 
-  if (load_path.size()) {
+  // resume from the compact progress of the run, if any, rather than
+  // replaying its episodes; the progress is saved at every checkpoint, after
+  // the weights of the checkpoint, which are then loaded instead of load=
+  bool resumed = false;
+  try {
+    resumed = progress_path.size() && stats.load_progress(progress_path, first);
+  } catch (std::invalid_argument& e) {
+    std::cerr << e.what() << std::endl;
+    return -1;
+  }
+  if (resumed) {
+    std::cerr << "resume from episode " << stats.step() << std::endl;
+    if (stats.is_finished()) stats.overview();
+    if (checkpoint_path.size()) slide_args += " load=" + checkpoint_path + ".weights";
+  }
+
+  if (load_path.size() && archive::is_archive(load_path)) {
+    archive_reader in(load_path);
+    stats.load(in);
+    if (stats.is_finished()) stats.summary();
+  } else if (load_path.size()) {
     std::ifstream in(load_path, std::ios::in);
     in >> stats;
     in.close();
     if (stats.is_finished()) stats.summary();
   }
 
+  if (save_path.size() && stream) stats.stream(save_path, binary);
+
+  // evaluate a frozen network, i.e., the tables are mapped read-only and
+  // shared, and the games are played in lockstep batches by all the threads
+  if (eval) slide_args += " alpha=0";
+  if (eval && batch == 0 && !search) batch = 64;
+
+  // play by the expectimax search on top of the frozen network, whose depth,
+  // time, and transposition table are given by --slide, see expectimax_slider
+  if (search) slide_args += " alpha=0";
+  if (search && (batch || daemon.size())) {
+    std::cerr << "--search plays one game at a time, without --batch or --daemon"
+              << std::endl;
+    return -1;
+  }
+
   // random_slider slide(slide_args);
   // merge_larger_agent slide(slide_args);
+  // the patterns are those of the loaded weight file, or else those of
+  // set_default_encoding(), unless given, e.g., --slide="patterns=4x6", or set
+  // explicitly by
+  // slide.set_encoding({{0, 1, 2, 3}, {4, 5, 6, 7}}, 8)
   ntuple_slider slide(slide_args);
-  slide.set_encoding({
-    {0, 1, 2, 4, 5, 6},
-    {4, 5, 6, 8, 9, 10},
-    {5, 6, 7, 9, 10, 11},
-    {9, 10, 11, 13, 14, 15}
-  });
   random_placer place(place_args);
 
-  while (!stats.is_finished()) {
-    // std::cerr << "======== Game " << stats.step() << " ========" << std::endl;
-    slide.open_episode("~:" + place.name());
-    place.open_episode(slide.name() + ":~");
-
-    stats.open_episode(slide.name() + ":" + place.name());
-    episode& game = stats.back();
-    while (true) {
-      agent& who = game.take_turns(slide, place);
-      action move = who.take_action(game.state());
-      // std::cerr << game.state() << "#" << game.step() << " " << who.name() << ": " << move << std::endl;
-      if (game.apply_action(move) != true) break;
-      if (who.check_for_win(game.state())) break;
+  // the progress of a training is only as good as the weights saved with it
+  if (progress_path.size() && checkpoint_path.empty() && slide.learning()) {
+    std::cerr << "--progress with alpha != 0 needs --checkpoint for the weights"
+              << std::endl;
+    return -1;
+  }
+
+  // act as the parameter server of a distributed training, whose actors are
+  // run with --slide="server=HOST:PORT", and then save the tables
+  if (serve && actors == 0) {
+    std::cerr << "--serve needs the number of actors, e.g., --serve=7788/4"
+              << std::endl;
+    return -1;
+  }
+  if (serve) {
+    if (auto* weights = dynamic_cast<weight_agent*>(&slide))
+      weights->serve(serve, actors);
+    return 0;
+  }
+
+  // answer the moves of boards sent by other programs with the frozen network
+  // until interrupted, where every thread serves requests, see service.h
+  if (daemon.size()) {
+    if (slide.learning()) {
+      std::cerr << "daemon mode does not train, use alpha=0" << std::endl;
+      return -1;
+    }
+    move_server server(daemon, slide, thread);
+    server.stop_on_signals();
+    server.run();
+    return 0;
+  }
+
+  // each worker thread plays with its own pair of agents, while the sliders
+  // share the weight tables of the original one
+  std::vector<decltype(slide)> slides(thread, slide);
+  std::vector<random_placer> places(thread, place);
+  std::vector<expectimax_slider> searches;
+  if (search) searches.assign(thread, expectimax_slider(slide_args));
+
+  // a checkpoint holds the weights and the statistics with its counters, so
+  // the run can be resumed by --load=PATH.stats --slide="load=PATH.weights"
+  // with --progress, the statistics are saved as the compact progress, every
+  // block unless given by --every or --interval
+  if (progress_path.size() && !every && !interval) every = block ? block : total;
+  bool checkpoints = checkpoint_path.size() || progress_path.size();
+  checkpointer checkpoint(checkpoints ? every : 0, checkpoints ? interval : 0);
+  auto save_checkpoint = [&] {
+    // the child leaves by _exit, as exit would run the handlers of the parent
+    if (checkpoint_path.size()) {
+      if (auto* weights = dynamic_cast<weight_agent*>(&slide))
+        if (!weights->checkpoint(checkpoint_path + ".weights")) ::_exit(1);
+    }
+    if (progress_path.size() && !stats.save_progress(progress_path, first)) {
+      std::cerr << "checkpoint: cannot save progress " << progress_path << std::endl;
+      ::_exit(1);
+    }
+    if (progress_path.size() || checkpoint_path.empty()) return;
+    std::string temp = checkpoint_path + ".stats.tmp";
+    std::ofstream out(temp, std::ios::out | std::ios::trunc);
+    out << stats;
+    out.close();
+    if (!out || std::rename(temp.c_str(), (checkpoint_path + ".stats").c_str())) {
+      std::cerr << "checkpoint: cannot save " << checkpoint_path << ".stats" << std::endl;
+      ::_exit(1);
+    }
+  };
+
+  // play the games in lockstep batches of the given width with the frozen
+  // network, where every thread plays a chunk of episodes at a time, and the
+  // chunks are appended in order; as the games only depend on their indices,
+  // the records are the same with any --thread and --batch
+  if (batch && slide.learning()) {
+    std::cerr << "batch mode does not train, use alpha=0" << std::endl;
+    return -1;
+  }
+  std::vector<batch_simulator> sims;
+  for (size_t i = 0; batch && i < thread; i++)
+    sims.emplace_back(slides[i], places[i], batch);
+  size_t chunk = std::max<size_t>(batch * 8, 256);
+
+  // the games are played in segments, between which the workers are idle, so
+  // that a checkpoint forks the process while no other thread may hold a
+  // lock, e.g., of malloc or of a stream; a segment ends at every checkpoint
+  // due by --every, or at every block (1000 episodes if none) for --interval
+  size_t segment = total;
+  if (checkpoints && every) segment = every;
+  else if (checkpoints && interval) segment = block ? block : 1000;
+  for (size_t from = stats.step(); from < total;) {
+    size_t to = std::min((from / segment + 1) * segment, total);
+
+#pragma omp parallel for ordered schedule(dynamic) num_threads(thread)
+    for (size_t begin = batch ? from : to; begin < to; begin += chunk) {
+      size_t end = std::min(begin + chunk, to);
+      std::vector<episode> games(end - begin);  // in the order of the indices
+      std::vector<statistics::totals> tallies(end - begin);
+      sims[omp_get_thread_num()].run(begin, end, [&](episode&& game, size_t n) {
+        tallies[n - begin] = statistics::tally(game);
+        games[n - begin] = std::move(game);
+      });
+
+#pragma omp ordered
+      for (size_t n = 0; n < games.size(); n++)
+        stats.append_episode(std::move(games[n]), tallies[n]);
+    }
+
+#pragma omp parallel for ordered schedule(dynamic) num_threads(thread)
+    for (size_t n = batch ? to : from; n < to; n++) {
+      // std::cerr << "======== Game " << n << " ========" << std::endl;
+      agent& slider = search ? static_cast<agent&>(searches[omp_get_thread_num()])
+                             : slides[omp_get_thread_num()];
+      random_placer& placer = places[omp_get_thread_num()];
+      placer.reseed(n);  // the games do not depend on the threads
+      slider.open_episode("~:" + placer.name());
+      placer.open_episode(slider.name() + ":~");
+
+      episode game;
+      game.open_episode(slider.name() + ":" + placer.name());
+      while (true) {
+        agent& who = game.take_turns(slider, placer);
+        action move;
+        {
+          PROFILE_SCOPE(&who == &slider ? profile::slide : profile::place);
+          move = who.take_action(game.state());
+        }
+        // std::cerr << game.state() << "#" << game.step() << " " << who.name() << ": " << move << std::endl;
+        if (game.apply_action(move) != true) break;
+        if (who.check_for_win(game.state())) break;
+      }
+      agent& win = game.last_turns(slider, placer);
+      game.close_episode(win.name());
+
+      slider.close_episode(win.name());
+      placer.close_episode(win.name());
+      // tallied by every worker at the same time, and added in order
+      statistics::totals tally = statistics::tally(game);
+
+#pragma omp ordered
+      stats.append_episode(std::move(game), tally);
     }
-    agent& win = game.last_turns(slide, place);
-    stats.close_episode(win.name());
 
-    slide.close_episode(win.name());
-    place.close_episode(win.name());
+    from = to;
+    if (checkpoint.due(from)) {
+      stats.idle();  // the episode writer as well
+      checkpoint.take(save_checkpoint);
+    }
+  }
+
+  checkpoint.wait();  // for the last checkpoint, which may save the progress
+  if (progress_path.size() && !stats.save_progress(progress_path, first)) {
+    std::cerr << "cannot save progress " << progress_path << std::endl;
+    return -1;
+  }
+
+  if (checkpoint.checkpoints() + checkpoint.skips()) {
+    std::cerr << "checkpoints = " << checkpoint.checkpoints()
+              << ", skipped = " << checkpoint.skips() << std::endl;
   }
 
-  if (save_path.size()) {
+  if (save_path.size() && !stats.streaming() && binary) {
+    archive_writer out(save_path);
+    stats.save(out);
+  } else if (save_path.size() && !stats.streaming()) {
     std::ofstream out(save_path, std::ios::out | std::ios::trunc);
     out << stats;
     out.close();
@@ -1,6 +1,82 @@
+#pragma once
 #include <algorithm>
+#include <cstdint>
+#include <string>
 
 template <class ForwardIterator>
 inline size_t argmax(ForwardIterator first, ForwardIterator last) {
   return std::distance(first, std::max_element(first, last));
 }
+
+/**
+ * append an unsigned integer to a buffer as a LEB128 varint
+ */
+inline void put_varint(std::string& buf, uint64_t v) {
+  for (; v >= 0x80; v >>= 7) buf.push_back(char(v | 0x80));
+  buf.push_back(char(v));
+}
+
+/**
+ * read a LEB128 varint from [p, end) and advance p
+ * return false if the buffer ends before the varint does
+ */
+inline bool get_varint(const char*& p, const char* end, uint64_t& v) {
+  v = 0;
+  for (unsigned shift = 0; p != end && shift < 64; shift += 7) {
+    uint8_t byte = *(p++);
+    v |= uint64_t(byte & 0x7f) << shift;
+    if (byte < 0x80) return true;
+  }
+  return false;
+}
+
+/**
+ * the finalizer of splitmix64, a bijective mix of the 64 bits
+ */
+inline uint64_t mix64(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+/**
+ * xoshiro256++ by Blackman and Vigna, a small and fast generator which is also
+ * usable with std::shuffle and the distributions of <random>
+ * the state is filled by splitmix64 from a 64-bit seed
+ */
+class xoshiro256 {
+ public:
+  typedef uint64_t result_type;
+  explicit xoshiro256(uint64_t seed = 0) { this->seed(seed); }
+
+  void seed(uint64_t seed) {
+    for (uint64_t& v : s) v = mix64(seed += 0x9e3779b97f4a7c15ull);
+  }
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return ~result_type(0); }
+  result_type operator()() {
+    uint64_t r = rotl(s[0] + s[3], 23) + s[0];
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return r;
+  }
+
+  /**
+   * a uniform integer in [0, n) by a multiplication instead of a division,
+   * where the bias is at most n / 2^32
+   */
+  uint32_t below(uint32_t n) {
+    return (uint64_t(uint32_t(operator()() >> 32)) * n) >> 32;
+  }
+
+ private:
+  static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+  uint64_t s[4];
+};
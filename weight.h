@@ -8,42 +8,234 @@
  */
 
 #pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
 #include <iostream>
+#include <memory>
 #include <utility>
 #include <vector>
 
-class weight {
+/**
+ * IEEE 754 half-precision number, the storage of fp16 tables
+ */
+struct half {
+  uint16_t bits;
+
+  /**
+   * round a float to the nearest half, ties to even
+   */
+  static half from(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    uint16_t sign = (x >> 16) & 0x8000u;
+    uint32_t abs = x & 0x7fffffffu;
+    if (abs >= 0x7f800000u)  // inf or nan
+      return {uint16_t(sign | 0x7c00u | (abs > 0x7f800000u ? 0x200u : 0))};
+    if (abs >= 0x477ff000u) return {uint16_t(sign | 0x7c00u)};  // overflow
+    if (abs < 0x38800000u) {  // subnormal or zero
+      float sub;
+      uint32_t a = abs;
+      std::memcpy(&sub, &a, sizeof(sub));
+      return {uint16_t(sign | uint16_t(std::nearbyint(sub * 16777216.0f)))};
+    }
+    uint32_t m = abs + 0xc8000fffu + ((abs >> 13) & 1);  // rebias and round
+    return {uint16_t(sign | (m >> 13))};
+  }
+  operator float() const {
+#ifdef __F16C__
+    return _cvtsh_ss(bits);
+#else
+    // rebias the exponent of normal numbers, and scale the subnormal ones by
+    // an exact conversion, which avoids the slow float subnormals
+    uint32_t exp = bits & 0x7c00u, man = bits & 0x3ffu;
+    uint32_t x = ((uint32_t(bits & 0x7fffu) << 13) + 0x38000000u) |
+                 (exp == 0x7c00u ? 0x7f800000u : 0);
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    f = exp ? f : man * 5.9604644775390625e-8f;  // 2^-24
+    return bits & 0x8000u ? -f : f;
+#endif
+  }
+};
+
+/**
+ * lookup table of a n-tuple network, whose entries are stored as 'storage'
+ * float tables are used for training, while fp16 (half) and scaled int16
+ * (int16_t, read as entry * scale) tables take half the memory for inference
+ *
+ * a weight is a handle: copying or assigning one (or a vector of them) does
+ * NOT copy the entries, but shares the same table, which is relied on by the
+ * copies of weight_agent (one per worker thread), by the replicas of
+ * "numa=replicate", and by the parameter server; an update through any copy
+ * is seen by all of them, so use clone() wherever an independent table is
+ * needed, e.g., a snapshot to compare with or to modify apart
+ */
+template <typename storage>
+class basic_weight {
  public:
-  typedef float type;
+  typedef storage type;
 
  public:
-  weight() {}
-  weight(size_t len) : value(len) {}
-  weight(weight&& f) : value(std::move(f.value)) {}
-  weight(const weight& f) = default;
+  basic_weight() : length(0), factor(1) {}
+  basic_weight(size_t len, float scale = 1)
+      : value(new type[len](), std::default_delete<type[]>()),
+        length(len),
+        factor(scale) {}
+  /**
+   * a table living in memory owned by others, e.g., a mapped weight file;
+   * the owner is kept alive as long as any copy of the table
+   */
+  basic_weight(type* data, size_t len, const std::shared_ptr<void>& owner,
+               float scale = 1)
+      : value(owner, data), length(len), factor(scale) {}
+  basic_weight(basic_weight&& f) = default;
+  basic_weight(const basic_weight& f) = default;  // shares the table
+
+  basic_weight& operator=(basic_weight&& f) = default;
+  basic_weight& operator=(const basic_weight& f) = default;
+  type& operator[](size_t i) { return value.get()[i]; }
+  const type& operator[](size_t i) const { return value.get()[i]; }
+  size_t size() const { return length; }
+  type* data() { return value.get(); }
+  const type* data() const { return value.get(); }
+  float scale() const { return factor; }
+
+  /**
+   * the i-th entry as a float, whatever the storage is
+   */
+  float get(size_t i) const { return decode(value.get()[i], factor); }
+
+  /**
+   * an independent copy of the table, unlike the copy constructor
+   */
+  basic_weight clone() const {
+    basic_weight w(length, factor);
+    std::copy(value.get(), value.get() + length, w.value.get());
+    return w;
+  }
 
-  weight& operator=(const weight& f) = default;
-  type& operator[](size_t i) { return value[i]; }
-  const type& operator[](size_t i) const { return value[i]; }
-  size_t size() const { return value.size(); }
+ private:
+  static float decode(float v, float) { return v; }
+  static float decode(half v, float) { return v; }
+  static float decode(int16_t v, float scale) { return v * scale; }
 
  public:
-  friend std::ostream& operator<<(std::ostream& out, const weight& w) {
-    auto& value = w.value;
-    uint64_t size = value.size();
+  friend std::ostream& operator<<(std::ostream& out, const basic_weight& w) {
+    uint64_t size = w.size();
     out.write(reinterpret_cast<const char*>(&size), sizeof(uint64_t));
-    out.write(reinterpret_cast<const char*>(value.data()), sizeof(type) * size);
+    out.write(reinterpret_cast<const char*>(w.value.get()),
+              sizeof(type) * size);
     return out;
   }
-  friend std::istream& operator>>(std::istream& in, weight& w) {
-    auto& value = w.value;
+  friend std::istream& operator>>(std::istream& in, basic_weight& w) {
     uint64_t size = 0;
     in.read(reinterpret_cast<char*>(&size), sizeof(uint64_t));
-    value.resize(size);
-    in.read(reinterpret_cast<char*>(value.data()), sizeof(type) * size);
+    w = basic_weight(size);
+    in.read(reinterpret_cast<char*>(w.value.get()), sizeof(type) * size);
     return in;
   }
 
  protected:
-  std::vector<type> value;
+  std::shared_ptr<type> value;
+  size_t length;
+  float factor;
+};
+
+typedef basic_weight<float> weight;
+typedef basic_weight<half> half_weight;
+typedef basic_weight<int16_t> int16_weight;
+
+/**
+ * lookup table of a n-tuple network holding only some of its entries, e.g.,
+ * the non-zero ones visited in play, for inference; the others read as 0
+ *
+ * the entries are kept in an open-addressing hash table of (index, value)
+ * slots probed linearly from the home slot of an index, where a slot with
+ * value 0 ends the probing, so that a zeroed table is empty
+ */
+class sparse_weight {
+ public:
+  struct slot {
+    uint32_t index;
+    float value;
+  };
+
+ public:
+  sparse_weight() : length(0), count(0), shift(63) {}
+  /**
+   * a table living in memory owned by others, e.g., a mapped weight file,
+   * where 'slots' is a power of 2 (at least 2)
+   */
+  sparse_weight(const slot* data, size_t slots, size_t len,
+                const std::shared_ptr<void>& owner)
+      : value(owner, data),
+        length(len),
+        count(slots),
+        shift(64 - __builtin_ctzll(slots)) {}
+
+  size_t size() const { return length; }
+  size_t slots() const { return count; }
+  const slot* data() const { return value.get(); }
+  float scale() const { return 1; }
+
+  /**
+   * the i-th entry, or 0 if it is not kept
+   */
+  float get(size_t i) const {
+    size_t h = home(i, shift);
+    for (size_t n = 0; n < count; n++, h = (h + 1) & (count - 1)) {
+      const slot& s = value.get()[h];
+      if (s.index == i || s.value == 0) return s.value;
+    }
+    return 0;  // a full table, which build() never makes
+  }
+
+  /**
+   * whether the table has an empty slot, i.e., every probe ends there, as
+   * those of build() do; a table from a file should be checked
+   */
+  bool valid() const {
+    const slot* p = value.get();
+    return std::any_of(p, p + count, [](const slot& s) { return s.value == 0; });
+  }
+  const slot* address(size_t i) const { return &value.get()[home(i, shift)]; }
+
+  /**
+   * the slots of a table holding 'n' entries given by index(k) and value(k)
+   * for k in [0, n): a power of 2 at most 70% full, where the zero entries
+   * are left out
+   */
+  template <typename indices, typename values>
+  static std::vector<slot> build(size_t n, indices index, values value) {
+    std::vector<slot> kept;
+    for (size_t k = 0; k < n; k++) {
+      float v = value(k);
+      if (v != 0) kept.push_back({uint32_t(index(k)), v});
+    }
+    size_t slots = 2;
+    while (slots * 7 < kept.size() * 10) slots *= 2;
+    std::vector<slot> table(slots, slot{0, 0});
+    unsigned shift = 64 - __builtin_ctzll(slots);
+    for (const slot& s : kept) {
+      size_t h = home(s.index, shift);
+      while (table[h].value != 0) h = (h + 1) & (slots - 1);
+      table[h] = s;
+    }
+    return table;
+  }
+
+ private:
+  static size_t home(size_t i, unsigned shift) {
+    return (uint64_t(i) * 0x9e3779b97f4a7c15ull) >> shift;  // fibonacci hashing
+  }
+
+  std::shared_ptr<const slot> value;
+  size_t length;
+  size_t count;
+  unsigned shift;
 };